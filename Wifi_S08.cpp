@@ -7,6 +7,7 @@
 #include <Wifi_S08.h>
 #include <WString.h>
 #include <Arduino.h>
+#include <EEPROM.h>
 
 ESP8266 * ESP8266::_instance;
 
@@ -14,6 +15,7 @@ ESP8266 * ESP8266::_instance;
 const char ESP8266::READY[] = "ready";
 const char ESP8266::OK[] = "OK";
 const char ESP8266::OK_PROMPT[] = "OK\r\n>";
+const char ESP8266::OK_LINE[] = "\r\nOK\r\n";
 const char ESP8266::SEND_OK[] = "SEND OK";
 const char ESP8266::ERROR[] = "ERROR";
 const char ESP8266::FAIL[] = "FAIL";
@@ -21,6 +23,28 @@ const char ESP8266::STATUS[] = "STATUS:";
 const char ESP8266::ALREADY_CONNECTED[] = "ALREADY CONNECTED";
 const char ESP8266::HTML_START[] = "<html>";
 const char ESP8266::HTML_END[] = "</html>";
+const char ESP8266::CLOSED[] = "CLOSED";
+const char ESP8266::IPD[] = "+IPD,";
+const char ESP8266::CONTENT_LENGTH[] = "Content-Length:";
+const char ESP8266::TRANSFER_ENCODING[] = "Transfer-Encoding:";
+const char ESP8266::CHUNKED[] = "chunked";
+const char ESP8266::CONTENT_ENCODING[] = "Content-Encoding:";
+const char ESP8266::GZIP[] = "gzip";
+
+// Deflate tables: base and extra bits of each length and distance symbol,
+// and the order code length code lengths are sent in
+static const uint16_t inflateLengthBase[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11,
+	13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163,
+	195, 227, 258};
+static const uint8_t inflateLengthExtra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1,
+	1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const uint16_t inflateDistanceBase[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17,
+	25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073,
+	4097, 6145, 8193, 12289, 16385, 24577};
+static const uint8_t inflateDistanceExtra[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3,
+	3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+static const uint8_t inflateOrder[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5,
+	11, 4, 12, 3, 13, 2, 14, 1, 15};
 
 // Constructors and init method
 ESP8266::ESP8266() {
@@ -30,30 +54,127 @@ ESP8266::ESP8266() {
 void ESP8266::init(bool verboseSerial) {
 	_instance = this;  //static reference to this object, for ISR handler
 	serialYes = true;
+	started = false;
 	state = IDLE;
 
-	hasRequest = false;
+	requestActive = false;
+	nextRequestId = 1;
+	completionHead = 0;
+	completionCount = 0;
+	responseHeld = false;
 	responseReady = false;
+	responseTime = 0;
 	connected = false;
 	doAutoConn = true;
 	newNetworkInfo = false;
+	networkCount = 0;
+	networkIndex = -1;
+	joinFailures = 0;
+	rssi = 0;
+	lastRssiCheck = 0;
+	lastScan = 0;
+	requestStart = 0;
+	linkLatency = 0;
 	MAC = ""; 
 
 	receiveCount = 0;
 	transmitCount = 0;
 
+	store = NULL;
+	storeRequestId = 0;
+
+	trace = NULL;
+	tracing = false;
+	replaying = false;
+
 	ssid[0] = '\0'; 
 	password[0] = '\0';
 	response[0] = '\0';
+	responseLength = 0;
+	inputBuffer[0] = '\0';
+	ipdMatch = 0;
+	ipdHeader = false;
+	ipdRemaining = 0;
+	ipdLink = HTTP_LINK;
+	rxLineLength = 0;
+	muxReady = false;
+	for (int i = 0; i < LINKCOUNT; i++) {
+		linkOpen[i] = false;
+	}
+	for (int i = 0; i < LINKCOUNT - 1; i++) {
+		links[i].id = i + 1;
+		links[i].host[0] = '\0';
+		links[i].port = 0;
+		links[i].wanted = false;
+		links[i].restart = false;
+		links[i].lastAttempt = 0;
+		links[i].txLength = 0;
+		links[i].sendLength = 0;
+	}
+	link_p = &links[0];
+	httpState = HTTP_NONE;
+	gzip = false;
+	gzipRequest = false;
+	gzipBody = false;
+	inflater = NULL;
+	jsonFieldCount = 0;
+
+	mqttState = MQTT_DISCONNECTED;
+	mqttClientId[0] = '\0';
+	mqttUsername[0] = '\0';
+	mqttPassword[0] = '\0';
+	for (int i = 0; i < MQTT_MAXSUBS; i++) {
+		mqttSubs[i].callback = NULL;
+	}
+	for (int i = 0; i < MQTT_INBOXSIZE; i++) {
+		mqttInbox[i].full = false;
+	}
+	mqttPingOutstanding = false;
+	mqttNextPacketId = 1;
+	mqttInflightLength = 0;
+	mqttRxState = 0;
+
+	wsState = WS_CLOSED;
+	wsPath[0] = '\0';
+	wsCallback = NULL;
+	for (int i = 0; i < WS_INBOXSIZE; i++) {
+		wsInbox[i].full = false;
+	}
+	wsSlot = -1;
+	wsRandom = 1;
+	wsRxState = WS_RX_HANDSHAKE;
 
+	for (int i = 0; i < REQUESTQUEUESIZE; i++) {
+		requestQueue[i].id = 0;
+	}
+	for (int i = 0; i < COMMANDQUEUESIZE; i++) {
+		commandQueue[i].id = 0;
+	}
+	command_p = &commandQueue[0];
+	nextCommandId = 1;
+	endpointCount = 0;
+	queueLimit[PRIORITY_ALARM] = ALARM_QUEUE_LIMIT;
+	queueLimit[PRIORITY_NORMAL] = NORMAL_QUEUE_LIMIT;
+	queueLimit[PRIORITY_BULK] = BULK_QUEUE_LIMIT;
+	for (int i = 0; i < PRIORITYCOUNT; i++) { // The timer isn't running yet
+		latencyStats[i].count = 0;
+		latencyStats[i].failed = 0;
+		latencyStats[i].rejected = 0;
+		latencyStats[i].totalLatency = 0;
+		latencyStats[i].maxLatency = 0;
+	}
 	// Default initialization of request_p, to avoid NULL pointer exception
-	request_p = (volatile Request *)malloc(sizeof(Request));
-	request_p->domain[0] = '\0';
-	request_p->path[0] = '\0';
-	request_p->data[0] = '\0';
+	request_p = &requestQueue[0];
+	request_p->domain = "";
+	request_p->path = "";
+	request_p->data = "";
 	request_p->port = 0;
 	request_p->type = GET_REQ;
 	request_p->auto_retry = false;
+	request_p->priority = PRIORITY_NORMAL;
+	request_p->cancelled = false;
+	request_p->plain = false;
+	request_p->callback = NULL;
 }
 
 void ESP8266::begin() {
@@ -71,6 +192,7 @@ void ESP8266::begin() {
 		getMACFromDevice();
 		emptyRx();
 	}
+	started = true; //The FSM may run from now on
 	enableTimer();
 }
 
@@ -96,21 +218,97 @@ void ESP8266::connectWifi(String id, String pass) {
 		}
 	}
 	if (idOk && passOk) {
+		networkIndex = -1;
+		newNetworkInfo = true;
+	}
+}
+
+// Add a network to roam between.  The first one added is joined unless
+// connectWifi() was called.  While connected, signal strength is sampled
+// every RSSI_INTERVAL between requests.  Below ROAM_RSSI, with requests also
+// averaging over ROAM_LATENCY, the FSM scans and moves to a candidate at
+// least ROAM_HYSTERESIS dB stronger, at most once per ROAM_COOLDOWN.  A
+// failed join moves on to the next candidate.  A network given to
+// connectWifi() is retried instead, and never roamed away from.
+bool ESP8266::addNetwork(String id, String pass) {
+	if (id == "" || id.length() > SSIDSIZE - 1
+			|| pass.length() > PASSWORDSIZE - 1
+			|| networkCount >= NETWORKCOUNT) {
+		if (serialYes) {
+			Serial.println("Could not add network");
+		}
+		return false;
+	}
+	disableTimer();
+	Network *n = &networks[networkCount];
+	id.toCharArray(n->ssid, SSIDSIZE);
+	pass.toCharArray(n->password, PASSWORDSIZE);
+	networkCount++;
+	if (ssid[0] == '\0') {
+		useNetwork(networkCount - 1);
 		newNetworkInfo = true;
 	}
+	enableTimer();
+	return true;
+}
+
+void ESP8266::clearNetworks() {
+	disableTimer();
+	networkCount = 0;
+	networkIndex = -1;
+	enableTimer();
+}
+
+// Signal strength of the current AP in dBm, or 0 if it hasn't been sampled.
+// Only sampled once networks have been added with addNetwork().
+int ESP8266::getRSSI() {
+	return rssi;
 }
 
 bool ESP8266::isBusy() {
-	return hasRequest;
+	for (int i = 0; i < REQUESTQUEUESIZE; i++) {
+		if (requestQueue[i].id != 0) {
+			return true;
+		}
+	}
+	return false;
 }
 
-void ESP8266::sendRequest(int type, String domain, int port, String path, 
+int ESP8266::sendRequest(int type, String domain, int port, String path, 
 		String data) {
-	sendRequest(type, domain, port, path, data, false);
+	return sendRequest(type, domain, port, path, data, false, NULL);
 }
 
-void ESP8266::sendRequest(int type, String domain, int port, String path, 
+int ESP8266::sendRequest(int type, String domain, int port, String path, 
 		String data, bool auto_retry) {
+	return sendRequest(type, domain, port, path, data, auto_retry, NULL);
+}
+
+int ESP8266::sendRequest(int type, String domain, int port, String path, 
+		String data, RequestCallback callback) {
+	return sendRequest(type, domain, port, path, data, false, callback);
+}
+
+int ESP8266::sendRequest(int type, String domain, int port, String path, 
+		String data, bool auto_retry, RequestCallback callback) {
+	return sendPriorityRequest(PRIORITY_NORMAL, type, domain, port, path, data,
+			auto_retry, callback);
+}
+
+// Queue a request for the FSM.  Returns an id identifying the request in its
+// callback and in cancelRequest(), or -1 if the request was not queued.  With
+// the store enabled, requests made while disconnected or with the queue full
+// are saved to it instead and 0 is returned.  Stored requests keep their
+// priority and auto_retry, and stored alarms are resent first, but the
+// callback isn't kept.
+// domain, path and data are copied back to back into REQUESTTEXTSIZE bytes,
+// which holds the longest data with up to 256 bytes of domain and path.
+// Endpoint requests only copy data.
+// Higher priority requests are sent first, and alarm and normal requests
+// postpone the periodic connection check by up to CONNCHECK_MAXDEFER.
+int ESP8266::sendPriorityRequest(int priority, int type, String domain,
+		int port, String path, String data, bool auto_retry,
+		RequestCallback callback) {
 	RequestType _type;
 	if (type == GET) {
 		_type = GET_REQ;
@@ -118,39 +316,518 @@ void ESP8266::sendRequest(int type, String domain, int port, String path,
 		_type = POST_REQ;
 	} else {
 		Serial.println("Error: Request type must be GET or POST");
-		return;
+		return -1;
 	}
-	if (domain.length() > DOMAINSIZE - 1 ||
-			path.length() > PATHSIZE - 1 ||
-			data.length() > DATASIZE -1) {
+	if (domain.length() > DOMAINSIZE - 1 || path.length() > PATHSIZE - 1
+			|| data.length() > DATASIZE - 1) {
 		Serial.println("Domain, path, or data is too long");
-	} else if (!hasRequest) { // Only send request if one isn't pending already
-		disableTimer();
-		domain.toCharArray((char *)request_p->domain, DOMAINSIZE);
-		path.toCharArray((char *)request_p->path, PATHSIZE);
-		data.toCharArray((char *)request_p->data, DATASIZE);
-		request_p->port = port;
-		request_p->type = _type;
-		request_p->auto_retry = auto_retry;
-		hasRequest = true;
-		responseReady = false;	
-		enableTimer();
-		//benchmark = millis();
-		Serial.println("Request Sent");
+		return -1;
+	}
+	if (domain.length() + path.length() + data.length() + 3
+			> REQUESTTEXTSIZE) { //Copied back to back, null terminated
+		Serial.println("Domain, path and data together are too long");
+		return -1;
+	}
+	return queueRequest(priority, _type, domain.c_str(), port, path.c_str(),
+			true, data.c_str(), auto_retry, callback);
+}
+
+// Register a fixed request target, returning a handle for
+// sendEndpointRequest(), or -1 if the table is full.  domain and path aren't
+// copied, so they must stay valid, e.g. string literals or static const
+// arrays, which stay in flash.
+int ESP8266::addEndpoint(int type, const char *domain, int port,
+		const char *path) {
+	if ((type != GET && type != POST) || domain == NULL || path == NULL
+			|| strlen(domain) > DOMAINSIZE - 1 || strlen(path) > PATHSIZE - 1
+			|| endpointCount >= ENDPOINTCOUNT) {
+		Serial.println("Error: Could not add endpoint");
+		return -1;
+	}
+	Endpoint *e = &endpoints[endpointCount];
+	e->domain = domain;
+	e->path = path;
+	e->port = port;
+	e->type = (type == GET) ? GET_REQ : POST_REQ;
+	return endpointCount++;
+}
+
+int ESP8266::sendEndpointRequest(int endpoint, String data,
+		RequestCallback callback) {
+	return sendPriorityEndpointRequest(PRIORITY_NORMAL, endpoint, data, false,
+			callback);
+}
+
+// As sendPriorityRequest(), but only data is copied into the queue
+int ESP8266::sendPriorityEndpointRequest(int priority, int endpoint,
+		String data, bool auto_retry, RequestCallback callback) {
+	if (endpoint < 0 || endpoint >= endpointCount) {
+		Serial.println("Error: Invalid endpoint");
+		return -1;
+	}
+	if (data.length() > DATASIZE - 1) {
+		Serial.println("Data is too long");
+		return -1;
+	}
+	Endpoint *e = &endpoints[endpoint];
+	return queueRequest(priority, e->type, e->domain, e->port, e->path, false,
+			data.c_str(), auto_retry, callback);
+}
+
+// Limit how many requests of a priority class may be queued at once.  By
+// default normal and bulk traffic can't fill the queue, leaving room for
+// alarms.
+void ESP8266::setQueueLimit(int priority, int limit) {
+	if (priority >= 0 && priority < PRIORITYCOUNT) {
+		queueLimit[priority] = limit;
+	}
+}
+
+bool ESP8266::getLatencyStats(int priority, LatencyStats *stats) {
+	if (priority < 0 || priority >= PRIORITYCOUNT || stats == NULL) {
+		return false;
+	}
+	disableTimer();
+	volatile LatencyStats *l = &latencyStats[priority];
+	stats->count = l->count;
+	stats->failed = l->failed;
+	stats->rejected = l->rejected;
+	stats->totalLatency = l->totalLatency;
+	stats->maxLatency = l->maxLatency;
+	enableTimer();
+	return true;
+}
+
+void ESP8266::resetLatencyStats() {
+	disableTimer();
+	for (int i = 0; i < PRIORITYCOUNT; i++) {
+		latencyStats[i].count = 0;
+		latencyStats[i].failed = 0;
+		latencyStats[i].rejected = 0;
+		latencyStats[i].totalLatency = 0;
+		latencyStats[i].maxLatency = 0;
+	}
+	enableTimer();
+}
+
+// Cancel a queued or in-progress request.  A queued request's callback is
+// invoked immediately; an in-progress one completes with REQUEST_CANCELLED
+// through poll() once the FSM has closed its connection.
+bool ESP8266::cancelRequest(int id) {
+	if (id <= 0) {
+		return false;
+	}
+	disableTimer();
+	volatile Request *r = NULL;
+	for (int i = 0; i < REQUESTQUEUESIZE; i++) {
+		if (requestQueue[i].id == id) {
+			r = &requestQueue[i];
+		}
+	}
+	RequestCallback callback = NULL;
+	unsigned long latency = 0;
+	if (r != NULL && requestActive && r == request_p && !r->spillError) {
+		r->cancelled = true;
+	} else if (r != NULL) {
+		callback = r->callback;
+		latency = fsmMillis() - r->startTime;
+		latencyStats[r->priority].failed++;
+		r->id = 0;
+	}
+	enableTimer();
+	if (callback != NULL) {
+		callback(id, 0, NULL, 0, latency, REQUEST_CANCELLED);
+	}
+	return r != NULL;
+}
+
+// Save requests made while offline, or that fail, to a persistent log and
+// resend them in order once connected.  Acknowledged entries are compacted
+// away as space is needed.  Without an argument the EEPROM is used.
+bool ESP8266::enableStore() {
+	return enableStore(&eepromStore);
+}
+
+bool ESP8266::enableStore(WifiStore *s) {
+	if (s == NULL || s->length() < STORE_HEADER + 4) {
+		return false;
+	}
+	store = s;
+	storeRequestId = 0;
+	storeSending = -1;
+	lastStoreDrain = millis();
+	storeDelay = STORE_DRAIN_INTERVAL;
+	storeScan();
+	if (serialYes) {
+		Serial.print("Store has ");
+		Serial.print(storeCount);
+		Serial.println(" pending requests");
+	}
+	return true;
+}
+
+// Stop using the store; pending entries stay in it for next time
+void ESP8266::disableStore() {
+	store = NULL;
+}
+
+// Ask for gzip compressed responses, and inflate them as they arrive.  A body
+// with back references reaching further than INFLATE_WINDOWSIZE bytes can't
+// be inflated, so the request is sent again once without asking for gzip.
+// Returns false if the inflater couldn't be allocated.
+bool ESP8266::enableGzip() {
+	disableTimer();
+	if (inflater == NULL) {
+		inflater = (Inflater *)malloc(sizeof(Inflater));
+	}
+	if (inflater != NULL) {
+		gzip = true;
 	} else if (serialYes) {
-		Serial.println("Could not make request; one is already in progress");
+		Serial.println("Could not allocate inflater");
 	}
+	enableTimer();
+	return inflater != NULL;
+}
+
+void ESP8266::disableGzip() {
+	gzip = false;
+}
+
+int ESP8266::getStoredCount() {
+	return (store == NULL) ? 0 : storeCount;
 }
 
 void ESP8266::clearRequest() {
-	disableTimer();
-	if (serialYes && hasRequest) {
+	bool cleared = false;
+	for (int i = 0; i < REQUESTQUEUESIZE; i++) {
+		int id = requestQueue[i].id;
+		if (id != 0) {
+			cleared = cancelRequest(id) || cleared;
+		}
+	}
+	if (serialYes && cleared) {
 		Serial.println("Cleared in-progress request");
 	}
-	hasRequest = false;
+}
+
+// Deliver finished requests and commands to their callbacks.  Call this from
+// loop(); the FSM won't start a new request while a response awaits delivery
+// here, or for up to RESPONSE_HOLD_TIMEOUT through getResponse().
+void ESP8266::poll() {
+	if (store != NULL) {
+		serviceStore();
+	}
+	for (int i = 0; i < COMMANDQUEUESIZE; i++) {
+		volatile Command *cmd = &commandQueue[i];
+		if (cmd->id != 0 && cmd->done) { //The FSM is done with this slot
+			int id = cmd->id;
+			CommandCallback callback = cmd->callback;
+			cmd->id = 0;
+			callback(id, cmd->result, cmd->buffer, strlen(cmd->buffer),
+					cmd->elapsed);
+		}
+	}
+	for (int i = 0; i < MQTT_INBOXSIZE; i++) {
+		MqttMessage *m = &mqttInbox[i];
+		if (m->full) { //The FSM is done with this slot
+			for (int j = 0; j < MQTT_MAXSUBS; j++) {
+				if (mqttSubs[j].callback != NULL && mqttTopicMatches(
+							mqttSubs[j].filter, (char *)m->topic)) {
+					mqttSubs[j].callback((char *)m->topic,
+							(uint8_t *)m->payload, m->length);
+				}
+			}
+			m->full = false;
+		}
+	}
+	for (int i = 0; i < WS_INBOXSIZE; i++) {
+		WsMessage *m = &wsInbox[i];
+		if (m->full) { //The FSM is done with this slot
+			if (wsCallback != NULL) {
+				wsCallback((char *)m->data, m->length, m->binary);
+			}
+			m->full = false;
+		}
+	}
+	while (completionCount > 0) { // Avoid restarting the timer needlessly
+		disableTimer();
+		volatile Completion *v = &completions[completionHead];
+		Completion c;
+		c.id = v->id;
+		c.callback = v->callback;
+		c.status = v->status;
+		c.error = v->error;
+		c.latency = v->latency;
+		c.hasBody = v->hasBody;
+		completionHead = (completionHead + 1) % COMPLETIONQUEUESIZE;
+		completionCount--;
+		enableTimer();
+		if (c.hasBody) {
+			c.callback(c.id, c.status, (char *)response, responseLength,
+					c.latency, c.error);
+			response[0] = '\0';
+			responseLength = 0;
+			responseHeld = false;
+		} else {
+			c.callback(c.id, c.status, NULL, 0, c.latency, c.error);
+		}
+	}
+}
+
+// Keep an MQTT session open to host, reconnecting whenever it drops.  The
+// connection is made between requests once the network is up; subscriptions
+// are renewed each time it's made.  Replaces any previous broker.
+void ESP8266::connectMqtt(String host, int port, String clientId) {
+	connectMqtt(host, port, clientId, "", "");
+}
+
+void ESP8266::connectMqtt(String host, int port, String clientId,
+		String username, String password) {
+	volatile Link *link = &links[MQTT_LINK - 1];
+	disableTimer();
+	if (mqttState == MQTT_CONNECTED) {
+		const uint8_t disconnect[] = {0xE0, 0x00};
+		mqttSend(disconnect, sizeof(disconnect));
+	}
+	bool ok = stringToVolatileArray(host, link->host, DOMAINSIZE)
+		&& stringToVolatileArray(clientId, mqttClientId, MQTT_IDSIZE)
+		&& stringToVolatileArray(username, mqttUsername, MQTT_USERSIZE)
+		&& stringToVolatileArray(password, mqttPassword, MQTT_USERSIZE);
+	link->port = port;
+	link->wanted = ok;
+	link->restart = linkOpen[MQTT_LINK];
+	link->lastAttempt = fsmMillis() - LINK_RETRY_INTERVAL - 1;
+	enableTimer();
+	if (!ok && serialYes) {
+		Serial.println("MQTT host, client id or credentials too long");
+	}
+}
+
+// Send DISCONNECT and close the MQTT session for good
+void ESP8266::disconnectMqtt() {
+	disableTimer();
+	if (mqttState == MQTT_CONNECTED) {
+		const uint8_t disconnect[] = {0xE0, 0x00};
+		mqttSend(disconnect, sizeof(disconnect));
+	}
+	links[MQTT_LINK - 1].wanted = false;
+	enableTimer();
+}
+
+bool ESP8266::isMqttConnected() {
+	return mqttState == MQTT_CONNECTED;
+}
+
+bool ESP8266::publishMqtt(String topic, String payload) {
+	return publishMqtt(topic, (const uint8_t *)payload.c_str(),
+			payload.length(), 0, false);
+}
+
+// Queue a message for the broker.  QoS 1 messages are resent until
+// acknowledged, and only one can be outstanding at a time.  Returns false if
+// the session isn't up, the message is too big, or there's no room for it.
+bool ESP8266::publishMqtt(String topic, const uint8_t *payload, int length,
+		int qos, bool retain) {
+	if (qos < 0 || qos > 1 || topic.length() > MQTT_TOPICSIZE - 1
+			|| length < 0 || (payload == NULL && length > 0)) {
+		return false; //QoS 2 isn't supported
+	}
+	int remaining = 2 + topic.length() + (qos > 0 ? 2 : 0) + length;
+	if (remaining + 5 > MQTT_PACKETSIZE) {
+		return false;
+	}
+	uint8_t packet[MQTT_PACKETSIZE];
+	int pos = mqttHeader(packet, 0x30 | (qos << 1) | (retain ? 1 : 0),
+			remaining); //PUBLISH
+	pos += mqttString(packet + pos, topic.c_str());
+	disableTimer();
+	bool ok = mqttState == MQTT_CONNECTED
+		&& (qos == 0 || mqttInflightLength == 0);
+	if (ok) {
+		int id = 0;
+		if (qos > 0) {
+			id = mqttPacketId();
+			packet[pos++] = id >> 8;
+			packet[pos++] = id & 0xFF;
+		}
+		memcpy(packet + pos, payload, length);
+		pos += length;
+		ok = mqttSend(packet, pos);
+		if (ok && qos > 0) {
+			for (int i = 0; i < pos; i++) {
+				mqttInflight[i] = packet[i];
+			}
+			mqttInflightLength = pos;
+			mqttInflightId = id;
+			mqttInflightSent = fsmMillis();
+		}
+	}
+	enableTimer();
+	return ok;
+}
+
+// Deliver messages on topics matching filter to callback from poll().
+// Subscribing to a filter again replaces its callback.  Returns false if
+// there's no free subscription slot.
+bool ESP8266::subscribeMqtt(String filter, int qos, MqttCallback callback) {
+	if (filter.length() == 0 || filter.length() > MQTT_TOPICSIZE - 1
+			|| qos < 0 || qos > 1 || callback == NULL) {
+		return false;
+	}
+	int slot = -1;
+	for (int i = 0; i < MQTT_MAXSUBS; i++) {
+		if (mqttSubs[i].callback != NULL
+				&& strcmp(mqttSubs[i].filter, filter.c_str()) == 0) {
+			slot = i;
+			break;
+		} else if (mqttSubs[i].callback == NULL && slot < 0) {
+			slot = i;
+		}
+	}
+	if (slot < 0) {
+		return false;
+	}
+	disableTimer();
+	strcpy(mqttSubs[slot].filter, filter.c_str());
+	mqttSubs[slot].qos = qos;
+	mqttSubs[slot].callback = callback;
+	if (mqttState == MQTT_CONNECTED) {
+		mqttSubscribe(slot);
+	}
+	enableTimer();
+	return true;
+}
+
+bool ESP8266::unsubscribeMqtt(String filter) {
+	for (int i = 0; i < MQTT_MAXSUBS; i++) {
+		if (mqttSubs[i].callback != NULL
+				&& strcmp(mqttSubs[i].filter, filter.c_str()) == 0) {
+			disableTimer();
+			mqttSubs[i].callback = NULL;
+			if (mqttState == MQTT_CONNECTED) {
+				uint8_t packet[MQTT_TOPICSIZE + 8];
+				int pos = mqttHeader(packet, 0xA2, 2 + 2 + filter.length());
+				int id = mqttPacketId();
+				packet[pos++] = id >> 8;
+				packet[pos++] = id & 0xFF;
+				pos += mqttString(packet + pos, mqttSubs[i].filter);
+				mqttSend(packet, pos); //UNSUBSCRIBE
+			}
+			enableTimer();
+			return true;
+		}
+	}
+	return false;
+}
+
+// Keep a WebSocket open to ws://host:port/path, reopening it whenever it
+// drops.  Messages from the server are passed to callback from poll().
+// Returns false if host and path are too long for the handshake.
+bool ESP8266::connectWebSocket(String host, int port, String path,
+		WebSocketCallback callback) {
+	volatile Link *link = &links[WS_LINK - 1];
+	// stringToVolatileArray() needs room for more than the terminator
+	if (host.length() + path.length() + WS_HANDSHAKE_FIXED_LEN > LINK_TXSIZE
+			|| host.length() >= DOMAINSIZE - 1
+			|| path.length() >= PATHSIZE - 1) {
+		if (serialYes) {
+			Serial.println("WebSocket host or path too long");
+		}
+		return false;
+	}
+	disableTimer();
+	if (wsState == WS_OPEN) {
+		const uint8_t goingAway[] = {0x03, 0xE9}; //1001
+		wsFrame(0x8, goingAway, sizeof(goingAway)); //Close
+	}
+	bool ok = stringToVolatileArray(host, link->host, DOMAINSIZE)
+		&& stringToVolatileArray(path, wsPath, PATHSIZE);
+	if (!ok) {
+		link->wanted = false;
+		enableTimer();
+		return false;
+	}
+	link->port = port;
+	wsCallback = callback;
+	wsRandom = (wsRandom ^ micros()) | 1; //Never zero, for xorshift
+	link->wanted = true;
+	link->restart = linkOpen[WS_LINK];
+	link->lastAttempt = fsmMillis() - LINK_RETRY_INTERVAL - 1;
+	enableTimer();
+	return true;
+}
+
+// Send a close frame and close the WebSocket for good
+void ESP8266::disconnectWebSocket() {
+	disableTimer();
+	if (wsState == WS_OPEN) {
+		const uint8_t normal[] = {0x03, 0xE8}; //1000
+		wsFrame(0x8, normal, sizeof(normal)); //Close
+	}
+	wsState = WS_CLOSED;
+	links[WS_LINK - 1].wanted = false;
+	enableTimer();
+}
+
+bool ESP8266::isWebSocketConnected() {
+	return wsState == WS_OPEN;
+}
+
+bool ESP8266::sendWebSocket(String text) {
+	return sendWebSocket((const uint8_t *)text.c_str(), text.length(), false);
+}
+
+// Queue a message as a single frame.  Frames are written straight into the
+// link's transmit buffer, and everything queued goes out in one CIPSEND.
+// Returns false if the WebSocket isn't open or there's no room.
+bool ESP8266::sendWebSocket(const uint8_t *data, int length, bool binary) {
+	if (length < 0 || (data == NULL && length > 0)) {
+		return false;
+	}
+	disableTimer();
+	bool ok = wsState == WS_OPEN && wsFrame(binary ? 0x2 : 0x1, data, length);
+	enableTimer();
+	return ok;
+}
+
+// Extract the value at path from each JSON response as it streams in.  Path
+// components are separated by '.' and array elements are numbered from 0,
+// e.g. "data.items.0.id".  dest must point to a long, float or bool, or for
+// JSON_STRING a char array of size bytes.  Returns the field's index for
+// isJsonFieldSet(), or -1 if it couldn't be added.
+int ESP8266::addJsonField(String path, int type, void *dest, int size) {
+	if (jsonFieldCount >= JSONFIELDS || path.length() > JSON_PATHSIZE - 1
+			|| type < JSON_INT || type > JSON_STRING || dest == NULL
+			|| (type == JSON_STRING && size < 1)) {
+		if (serialYes) {
+			Serial.println("Could not add JSON field");
+		}
+		return -1;
+	}
+	disableTimer();
+	int index = jsonFieldCount;
+	JsonField *f = &jsonFields[index];
+	path.toCharArray(f->path, JSON_PATHSIZE);
+	f->type = type;
+	f->dest = dest;
+	f->size = size;
+	f->set = false;
+	jsonFieldCount = index + 1;
+	enableTimer();
+	return index;
+}
+
+void ESP8266::clearJsonFields() {
+	disableTimer();
+	jsonFieldCount = 0;
 	enableTimer();
 }
 
+// Whether the field was found in the most recent response
+bool ESP8266::isJsonFieldSet(int index) {
+	return index >= 0 && index < jsonFieldCount && jsonFields[index].set;
+}
+
 bool ESP8266::hasResponse() {
 	return responseReady;
 }
@@ -183,7 +860,7 @@ bool ESP8266::restore() {
 	disableTimer();
 	bool ok = true;
 	emptyRx();
-	wifiSerial.println(AT_RESTORE);
+	wifiTx.println(AT_RESTORE);
 	ok = ok && waitForTarget(READY, RESTORE_TIMEOUT);
 	ok = ok && reset();
 	enableTimer();
@@ -194,14 +871,15 @@ bool ESP8266::reset() {
 	disableTimer();
 	bool ok = true;
 	emptyRx();
-	wifiSerial.println(AT_CWAUTOCONN);
+	wifiTx.println(AT_CWAUTOCONN);
 	ok = ok && waitForTarget(OK, CWAUTOCONN_TIMEOUT);
 	emptyRx();
-	wifiSerial.println(AT_CWMODE);
+	wifiTx.println(AT_CWMODE);
 	ok = ok && waitForTarget(OK, CWMODE_TIMEOUT);
 	emptyRx();
-	wifiSerial.println(AT_RST);
+	wifiTx.println(AT_RST);
 	ok = ok && waitForTarget(READY, RST_TIMEOUT);
+	dropLinks(); //The restart closed every connection
 	if (serialYes) {
 		if (ok) {
 			Serial.println("Reset successful");
@@ -214,15 +892,16 @@ bool ESP8266::reset() {
 	return ok;
 }
 
+// Blocks for the whole timeout with the FSM stopped, see sendCommand()
 String ESP8266::sendCustomCommand(String command, unsigned long timeout) {
 	disableTimer();
 	emptyRx();
-	wifiSerial.println(command);
+	wifiTx.println(command);
 	String customResponse = "";
 	unsigned long startTime = millis();
 	while (millis() - startTime < timeout) {
-		if (wifiSerial.available()) {
-			char c = wifiSerial.read();
+		if (rxAvailable()) {
+			char c = readRx();
 			customResponse = customResponse + String(c);
 		}
 	}
@@ -230,6 +909,50 @@ String ESP8266::sendCustomCommand(String command, unsigned long timeout) {
 	return customResponse;
 }
 
+// Queue an AT command to be sent between requests.  It completes as soon as
+// terminator (or "OK" if terminator is empty) is received, "ERROR" is
+// received, or timeout ms pass.  Everything received is copied into buffer,
+// which must stay valid until callback runs from poll().  callback may be
+// NULL.  Returns an id, or -1 if the command couldn't be queued.
+int ESP8266::sendCommand(String command, String terminator, char *buffer,
+		int size, unsigned long timeout, CommandCallback callback) {
+	if (command.length() > COMMANDSIZE - 1 ||
+			terminator.length() > TERMINATORSIZE - 1 ||
+			buffer == NULL || size < 1) {
+		if (serialYes) {
+			Serial.println("Invalid custom command");
+		}
+		return -1;
+	}
+	int id = -1;
+	disableTimer();
+	for (int i = 0; i < COMMANDQUEUESIZE; i++) {
+		volatile Command *cmd = &commandQueue[i];
+		if (cmd->id == 0) {
+			command.toCharArray((char *)cmd->command, COMMANDSIZE);
+			if (terminator.length() == 0) {
+				terminator = OK;
+			}
+			terminator.toCharArray((char *)cmd->terminator, TERMINATORSIZE);
+			cmd->buffer = buffer;
+			cmd->buffer[0] = '\0';
+			cmd->size = size;
+			cmd->timeout = timeout;
+			cmd->callback = callback;
+			cmd->done = false;
+			id = nextCommandId;
+			nextCommandId = (id == 0x7FFFFFFF) ? 1 : id + 1;
+			cmd->id = id;
+			break;
+		}
+	}
+	enableTimer();
+	if (id == -1 && serialYes) {
+		Serial.println("Could not queue command; command queue is full");
+	}
+	return id;
+}
+
 bool ESP8266::isAutoConn() {
 	return doAutoConn;
 }
@@ -254,40 +977,224 @@ void ESP8266::resetReceiveCount() {
 	receiveCount = 0;
 }
 
-//// PRIVATE FUNCTIONS (Non-ISR only)
-void ESP8266::enableTimer() {
-	timer.begin(ESP8266::handleInterrupt, INTERRUPT_MICROS);
+// Start capturing every byte exchanged with the ESP8266 into a RAM ring of
+// TRACESIZE bytes.  Once full, the oldest records are overwritten.
+bool ESP8266::startTrace() {
+	disableTimer();
+	if (trace == NULL) {
+		trace = (uint8_t *)malloc(TRACESIZE);
+	}
+	if (trace != NULL) {
+		traceHead = 0;
+		traceTail = 0;
+		traceUsed = 0;
+		traceLast = -1;
+		traceLastTime = millis();
+		traceFlags = connected ? TRACE_CONNECTED : 0;
+		if (muxReady) {
+			traceFlags |= TRACE_MUX;
+		}
+		for (int i = 0; i < LINKCOUNT - 1; i++) {
+			if (linkOpen[links[i].id]) {
+				traceFlags |= TRACE_LINKOPEN << i;
+			}
+		}
+		if (mqttState == MQTT_CONNECTED) {
+			traceFlags |= TRACE_SESSION << (MQTT_LINK - 1);
+		}
+		if (wsState == WS_OPEN) {
+			traceFlags |= TRACE_SESSION << (WS_LINK - 1);
+		}
+		tracing = true;
+	} else if (serialYes) {
+		Serial.println("Could not allocate trace buffer");
+	}
+	enableTimer();
+	return trace != NULL;
 }
 
-void ESP8266::disableTimer() {
-	timer.end();
+void ESP8266::stopTrace() {
+	tracing = false;
 }
 
-// Check if ESP8266 is present, this 
-bool ESP8266::checkPresent() {
-	emptyRx();
-	wifiSerial.println(AT_BASIC);
-	bool ok = waitForTarget(OK, AT_TIMEOUT);
-	if (serialYes) {
-		if (ok) {
-			Serial.println("ESP8266 present");
-		} else {
-			Serial.println("ESP8266 not present");
+// Length of the trace dumpTrace() would print, including the flags byte
+int ESP8266::getTraceLength() {
+	return (trace == NULL) ? 0 : traceUsed + 1;
+}
+
+// Print the captured trace over Serial as a C array initializer, ready to be
+// pasted into a sketch and passed to replayTrace()
+void ESP8266::dumpTrace() {
+	disableTimer();
+	char hex[8];
+	Serial.print("// Wifi_S08 trace, ");
+	Serial.print(getTraceLength());
+	Serial.println(" bytes");
+	if (trace != NULL) {
+		sprintf(hex, "0x%02X,", traceFlags);
+		Serial.println(hex);
+		for (int i = 0; i < traceUsed; i++) {
+			sprintf(hex, "0x%02X,", trace[(traceTail + i) % TRACESIZE]);
+			Serial.print(hex);
+			if (i % 16 == 15 || i == traceUsed - 1) {
+				Serial.println();
+			}
 		}
-		Serial.flush();
 	}
-	return ok;
+	Serial.flush();
+	enableTimer();
 }
 
-// Blocking function (with timeout) to get MAC address of ESP8266
-void ESP8266::getMACFromDevice() {
-	MAC = "";
-	wifiSerial.println(AT_CIPAPMAC);	//Send MAC query
-	unsigned long start = millis();
-	bool foundMacStart = false;
+// Feed a trace from dumpTrace() back through the FSM.  Received bytes are
+// made available at their recorded times on a simulated clock that advances
+// one INTERRUPT_MICROS tick per call to processInterrupt(); transmitted bytes
+// are compared against the trace instead of being sent.  Set up the same
+// network info and requests as when capturing before calling this.  It
+// replaces the FSM's state with the trace's, so it must be called before
+// begin().  Returns true if everything the FSM sent matched the trace.
+bool ESP8266::replayTrace(const uint8_t *data, int length, ReplayStats *stats) {
+	if (length < 1) {
+		return false;
+	}
+	if (started) {
+		if (serialYes) {
+			Serial.println("Traces can only be replayed before begin()");
+		}
+		return false;
+	}
+	disableTimer();
+	bool wasTracing = tracing;
+	tracing = false;
+	unsigned long start = millis();
+	rxCursor.data = data + 1;
+	rxCursor.length = length - 1;
+	rxCursor.pos = 0;
+	rxCursor.remaining = 0;
+	rxCursor.time = start;
+	txCursor = rxCursor;
+	txMismatches = 0;
+	replayClock = start;
+	replaying = true;
+	connected = (data[0] & TRACE_CONNECTED) != 0;
+	muxReady = (data[0] & TRACE_MUX) != 0;
+	for (int i = 0; i < LINKCOUNT - 1; i++) {
+		linkOpen[links[i].id] = (data[0] & (TRACE_LINKOPEN << i)) != 0;
+		links[i].txLength = 0;
+		links[i].lastAttempt = start;
+	}
+	mqttState = (data[0] & (TRACE_SESSION << (MQTT_LINK - 1)))
+		? MQTT_CONNECTED : MQTT_DISCONNECTED;
+	mqttLastTx = start;
+	mqttPingOutstanding = false;
+	mqttRxState = 0;
+	wsState = (data[0] & (TRACE_SESSION << (WS_LINK - 1))) ? WS_OPEN : WS_CLOSED;
+	wsLastRx = start;
+	wsPingOutstanding = false;
+	wsRxState = WS_RX_OPCODE;
+	wsSlot = -1;
+	lastConnectionCheck = start;
+	inputBuffer[0] = '\0';
+	state = IDLE;
+
+	TraceCursor last = rxCursor; //Find when the trace ends
+	while (nextTraceRecord(&last, false)) {
+		last.pos += last.remaining;
+		last.remaining = 0;
+	}
+
+	ReplayStats s = {0, 0, 0, 0, 0};
+	unsigned long rxDoneTime = 0;
+	while (true) {
+		replayClock += INTERRUPT_MICROS / 1000;
+		unsigned long isrStart = micros();
+		processInterrupt();
+		unsigned long isrTime = micros() - isrStart;
+		s.ticks++;
+		s.isrMicros += isrTime;
+		if (isrTime > s.maxIsrMicros) {
+			s.maxIsrMicros = isrTime;
+		}
+		if (!nextTraceRecord(&rxCursor, false)) {
+			if (rxDoneTime == 0) {
+				rxDoneTime = replayClock;
+			}
+			// Let the FSM settle, without waiting on requests that the
+			// trace never answered
+			if (state == IDLE || replayClock - rxDoneTime > CWJAP_TIMEOUT) {
+				break;
+			}
+		} else if ((long)(replayClock - last.time) > CWJAP_TIMEOUT) {
+			break; //Nothing is reading what's left, e.g. with no network
+		}
+	}
+	while (nextTraceRecord(&txCursor, true)) { //Expected bytes never sent
+		txMismatches += txCursor.remaining;
+		txCursor.pos += txCursor.remaining;
+		txCursor.remaining = 0;
+	}
+	s.duration = replayClock - start;
+	s.txMismatches = txMismatches;
+	if (stats != NULL) {
+		*stats = s;
+	}
+	replaying = false;
+	tracing = wasTracing;
+	enableTimer();
+	return txMismatches == 0;
+}
+
+int EEPROMStore::length() {
+	return EEPROM.length();
+}
+
+uint8_t EEPROMStore::read(int address) {
+	return EEPROM.read(address);
+}
+
+void EEPROMStore::write(int address, uint8_t value) {
+	if (EEPROM.read(address) != value) { //Spare the EEPROM needless writes
+		EEPROM.write(address, value);
+	}
+}
+
+//// PRIVATE FUNCTIONS (Non-ISR only)
+// Does nothing until begin() is done with the ESP8266, so calls made from
+// setup() and begin()'s own blocking exchanges don't race the FSM
+void ESP8266::enableTimer() {
+	if (started) {
+		timer.begin(ESP8266::handleInterrupt, INTERRUPT_MICROS);
+	}
+}
+
+void ESP8266::disableTimer() {
+	timer.end();
+}
+
+// Check if ESP8266 is present, this 
+bool ESP8266::checkPresent() {
+	emptyRx();
+	wifiTx.println(AT_BASIC);
+	bool ok = waitForTarget(OK, AT_TIMEOUT);
+	if (serialYes) {
+		if (ok) {
+			Serial.println("ESP8266 present");
+		} else {
+			Serial.println("ESP8266 not present");
+		}
+		Serial.flush();
+	}
+	return ok;
+}
+
+// Blocking function (with timeout) to get MAC address of ESP8266
+void ESP8266::getMACFromDevice() {
+	MAC = "";
+	wifiTx.println(AT_CIPAPMAC);	//Send MAC query
+	unsigned long start = millis();
+	bool foundMacStart = false;
 	while (millis() - start < MAC_TIMEOUT) {
-		if (wifiSerial.available() > 0) {
-			char c = wifiSerial.read();
+		if (rxAvailable() > 0) {
+			char c = readRx();
 			if (serialYes) {
 				Serial.print(c);
 			}
@@ -313,8 +1220,8 @@ void ESP8266::getMACFromDevice() {
 
 // Empty wifi serial buffer
 void ESP8266::emptyRx() {
-	while (wifiSerial.available() > 0) {
-		char c = wifiSerial.read();
+	while (rxAvailable() > 0) {
+		char c = readRx();
 		if (serialYes) {
 			Serial.print(c);
 		}
@@ -327,8 +1234,8 @@ bool ESP8266::waitForTarget(const char *target, unsigned long timeout) {
 	String resp = "";
 	unsigned long start = millis();
 	while (millis() - start < timeout) {
-		if (wifiSerial.available() > 0) {
-			char c = wifiSerial.read();
+		if (rxAvailable() > 0) {
+			char c = readRx();
 			if (serialYes) {
 				Serial.print(c);
 			}
@@ -344,6 +1251,343 @@ bool ESP8266::waitForTarget(const char *target, unsigned long timeout) {
 	return false;
 }
 
+// Put a request in a free queue slot, or the store if it's enabled and the
+// request can't be queued.  Unless copy is false, domain and path are copied
+// into the slot along with data.
+int ESP8266::queueRequest(int priority, RequestType type, const char *domain,
+		int port, const char *path, bool copy, const char *data,
+		bool auto_retry, RequestCallback callback) {
+	if (priority < 0 || priority >= PRIORITYCOUNT) {
+		Serial.println("Error: Invalid request priority");
+		return -1;
+	}
+	int domainLength = copy ? strlen(domain) + 1 : 0;
+	int pathLength = copy ? strlen(path) + 1 : 0;
+	if (domainLength + pathLength + strlen(data) + 1 > REQUESTTEXTSIZE) {
+		Serial.println("Domain, path and data together are too long");
+		return -1;
+	}
+	int storeType = (type == GET_REQ) ? GET : POST;
+	bool storable = (store != NULL && callback != handleStoreResponse);
+	if (storable && !connected) {
+		return storeAppend(storeType, priority, auto_retry, domain, port, path,
+				data) ? 0 : -1;
+	}
+	int id = -1;
+	disableTimer();
+	if (!isBusy()) {
+		responseReady = false; //As before, a new request drops an unread one
+	}
+	int queued = 0;
+	for (int i = 0; i < REQUESTQUEUESIZE; i++) {
+		if (requestQueue[i].id != 0 && requestQueue[i].priority == priority) {
+			queued++;
+		}
+	}
+	for (int i = 0; i < REQUESTQUEUESIZE && queued < queueLimit[priority];
+			i++) {
+		volatile Request *r = &requestQueue[i];
+		if (r->id == 0) { // Free slot
+			char *text = (char *)r->text;
+			if (copy) {
+				memcpy(text, domain, domainLength);
+				r->domain = text;
+				memcpy(text + domainLength, path, pathLength);
+				r->path = text + domainLength;
+			} else {
+				r->domain = domain;
+				r->path = path;
+			}
+			strcpy(text + domainLength + pathLength, data);
+			r->data = text + domainLength + pathLength;
+			r->port = port;
+			r->type = type;
+			r->auto_retry = auto_retry;
+			r->priority = priority;
+			r->cancelled = false;
+			r->plain = false;
+			r->spillError = 0;
+			r->callback = callback;
+			r->startTime = fsmMillis();
+			id = nextRequestId;
+			nextRequestId = (id == 0x7FFFFFFF) ? 1 : id + 1;
+			r->id = id;
+			break;
+		}
+	}
+	if (id == -1) {
+		latencyStats[priority].rejected++;
+	}
+	enableTimer();
+	if (id != -1) {
+		Serial.println("Request Sent");
+	} else if (storable) {
+		return storeAppend(storeType, priority, auto_retry, domain, port, path,
+				data) ? 0 : -1;
+	} else if (serialYes) {
+		Serial.println("Could not make request; request queue is full");
+	}
+	return id;
+}
+
+// Append a pending request to the store, compacting it if it's out of space
+bool ESP8266::storeAppend(int type, int priority, bool auto_retry,
+		const char *domain, int port, const char *path, const char *data) {
+	int domainLen = strlen(domain) + 1;
+	int pathLen = strlen(path) + 1;
+	int dataLen = strlen(data);
+	int len = 5 + domainLen + pathLen + dataLen;
+	if (storeEnd + STORE_HEADER + len > store->length()) {
+		storeCompact();
+	}
+	if (storeEnd + STORE_HEADER + len > store->length()) {
+		if (serialYes) {
+			Serial.println("Could not store request; store is full");
+		}
+		return false;
+	}
+	int pos = storeEnd;
+	int end = pos + STORE_HEADER + len;
+	if (end < store->length()) {
+		store->write(end, STORE_FREE);
+	}
+	int i = pos + 1;
+	store->write(i++, len >> 8);
+	store->write(i++, len & 0xFF);
+	store->write(i++, type);
+	store->write(i++, priority);
+	store->write(i++, auto_retry);
+	store->write(i++, port >> 8);
+	store->write(i++, port & 0xFF);
+	for (int j = 0; j < domainLen; j++) {
+		store->write(i++, domain[j]);
+	}
+	for (int j = 0; j < pathLen; j++) {
+		store->write(i++, path[j]);
+	}
+	for (int j = 0; j < dataLen; j++) {
+		store->write(i++, data[j]);
+	}
+	store->write(pos, STORE_PENDING); //Commit the record
+	if (storeCount == 0) {
+		storeNext = pos;
+	}
+	storeEnd = end;
+	storeCount++;
+	if (serialYes) {
+		Serial.println("Request stored for later");
+	}
+	return true;
+}
+
+// Returns the size of the record at pos, or 0 if there's no valid one
+int ESP8266::storeRecordLength(int pos) {
+	if (pos + STORE_HEADER > store->length()) {
+		return 0;
+	}
+	uint8_t status = store->read(pos);
+	if (status != STORE_PENDING && status != STORE_DONE) {
+		return 0;
+	}
+	int len = STORE_HEADER + (store->read(pos + 1) << 8) + store->read(pos + 2);
+	return (pos + len <= store->length()) ? len : 0;
+}
+
+// Find the end of the log, and the oldest pending record in it
+void ESP8266::storeScan() {
+	int pos = 0;
+	storeCount = 0;
+	storeNext = -1;
+	int len;
+	while ((len = storeRecordLength(pos)) > 0) {
+		if (store->read(pos) == STORE_PENDING) {
+			storeCount++;
+			if (storeNext < 0) {
+				storeNext = pos;
+			}
+		}
+		pos += len;
+	}
+	if (pos < store->length() && store->read(pos) != STORE_FREE) {
+		store->write(pos, STORE_FREE); //Cut off a torn or corrupt record
+	}
+	storeEnd = pos;
+	if (storeNext < 0) {
+		storeNext = pos;
+	}
+}
+
+// Move pending records to the start of the store, dropping acknowledged
+// ones.  A power loss part way through may lose pending records.
+void ESP8266::storeCompact() {
+	int dst = 0;
+	int src = 0;
+	int len;
+	while (src < storeEnd && (len = storeRecordLength(src)) > 0) {
+		if (store->read(src) == STORE_PENDING) {
+			if (src == storeSending) {
+				storeSending = dst;
+			}
+			if (dst != src) {
+				for (int i = 1; i < len; i++) {
+					store->write(dst + i, store->read(src + i));
+				}
+				store->write(dst, STORE_PENDING);
+			}
+			dst += len;
+		}
+		src += len;
+	}
+	if (dst < store->length()) {
+		store->write(dst, STORE_FREE);
+	}
+	storeEnd = dst;
+	storeNext = 0;
+}
+
+// Save failed requests to the store, and resend stored ones while connected
+void ESP8266::serviceStore() {
+	for (int i = 0; i < REQUESTQUEUESIZE; i++) {
+		volatile Request *r = &requestQueue[i];
+		if (r->id == 0 || !r->spillError) {
+			continue;
+		}
+		int id = r->id;
+		int error = r->spillError;
+		RequestCallback callback = r->callback;
+		unsigned long latency = fsmMillis() - r->startTime;
+		if (storeAppend(r->type == GET_REQ ? GET : POST, r->priority,
+					r->auto_retry, (char *)r->domain, r->port, (char *)r->path,
+					(char *)r->data)) {
+			error = REQUEST_STORED;
+		}
+		r->id = 0;
+		if (callback != NULL) {
+			callback(id, 0, NULL, 0, latency, error);
+		}
+	}
+	if (storeRequestId != 0 || storeCount == 0 || !connected
+			|| millis() - lastStoreDrain < storeDelay) {
+		return;
+	}
+	// Alarms go first, otherwise records are resent oldest first
+	storeSending = storeNext;
+	int best = store->read(storeNext + STORE_HEADER + 1);
+	int len;
+	for (int p = storeNext; best > PRIORITY_ALARM && p < storeEnd
+			&& (len = storeRecordLength(p)) > 0; p += len) {
+		int level = store->read(p + STORE_HEADER + 1);
+		if (store->read(p) == STORE_PENDING && level < best) {
+			best = level;
+			storeSending = p;
+		}
+	}
+	char domain[DOMAINSIZE];
+	char path[PATHSIZE];
+	char data[DATASIZE];
+	int pos = storeSending + STORE_HEADER;
+	int end = storeSending + storeRecordLength(storeSending);
+	int type = store->read(pos++);
+	int priority = store->read(pos++);
+	bool auto_retry = store->read(pos++);
+	int port = store->read(pos++) << 8;
+	port |= store->read(pos++);
+	char *fields[3] = {domain, path, data};
+	int sizes[3] = {DOMAINSIZE, PATHSIZE, DATASIZE};
+	int lengths[3];
+	bool valid = (type == GET || type == POST);
+	for (int f = 0; f < 3; f++) { //Data is the rest of the record
+		int i = 0;
+		bool terminated = false;
+		while (pos < end && i < sizes[f] - 1) {
+			char c = store->read(pos++);
+			if (c == '\0' && f < 2) {
+				terminated = true;
+				break;
+			}
+			fields[f][i++] = c;
+		}
+		fields[f][i] = '\0';
+		lengths[f] = i;
+		valid = valid && (f < 2 ? terminated : pos == end);
+	}
+	if (priority < 0 || priority >= PRIORITYCOUNT) {
+		priority = PRIORITY_BULK;
+	}
+	// Resend through a matching endpoint if there is one, so only data has
+	// to fit in the queue slot, as when it was first sent
+	RequestType reqType = (type == GET) ? GET_REQ : POST_REQ;
+	Endpoint *e = NULL;
+	for (int i = 0; i < endpointCount && e == NULL; i++) {
+		if (endpoints[i].type == reqType && endpoints[i].port == port
+				&& strcmp(endpoints[i].domain, domain) == 0
+				&& strcmp(endpoints[i].path, path) == 0) {
+			e = &endpoints[i];
+		}
+	}
+	if (e == NULL && lengths[0] + lengths[1] + lengths[2] + 3
+			> REQUESTTEXTSIZE) {
+		valid = false;
+	}
+	if (!valid) { //It can never be sent, don't let it block the rest
+		if (serialYes) {
+			Serial.println("Dropping stored request that can't be resent");
+		}
+		storeAcknowledge(storeSending);
+		return;
+	}
+	int id;
+	if (e != NULL) {
+		id = queueRequest(priority, reqType, e->domain, port, e->path, false,
+				data, auto_retry, handleStoreResponse);
+	} else {
+		id = queueRequest(priority, reqType, domain, port, path, true, data,
+				auto_retry, handleStoreResponse);
+	}
+	if (id > 0) {
+		storeRequestId = id;
+	}
+	lastStoreDrain = millis();
+}
+
+// Mark the record at pos as done, and find the oldest pending one
+void ESP8266::storeAcknowledge(int pos) {
+	store->write(pos, STORE_DONE);
+	storeCount--;
+	if (storeCount == 0) { //Everything's acknowledged, start over
+		store->write(0, STORE_FREE);
+		storeEnd = 0;
+		storeNext = 0;
+		return;
+	}
+	if (pos != storeNext) { //An alarm went ahead
+		return;
+	}
+	do {
+		int len = storeRecordLength(pos);
+		if (len == 0) {
+			break;
+		}
+		pos += len;
+	} while (pos < storeEnd && store->read(pos) != STORE_PENDING);
+	storeNext = pos;
+}
+
+// Callback for resent stored requests
+void ESP8266::handleStoreResponse(int id, int status, const char *body,
+		int length, unsigned long latency, int error) {
+	ESP8266 *esp = _instance;
+	if (esp->store == NULL || id != esp->storeRequestId) {
+		return;
+	}
+	esp->storeRequestId = 0;
+	if (error != REQUEST_OK) { //Still can't get through, back off
+		esp->storeDelay = STORE_RETRY_INTERVAL;
+		return;
+	}
+	esp->storeDelay = STORE_DRAIN_INTERVAL;
+	esp->storeAcknowledge(esp->storeSending);
+}
 
 bool ESP8266::stringToVolatileArray(String str, volatile char arr[],
 	   	uint32_t len) {
@@ -368,25 +1612,67 @@ void ESP8266::processInterrupt() {
 	switch (state) {
 		case IDLE:
 			{
-			bool autoCheck = doAutoConn
-				&& (millis() - lastConnectionCheck > CONNCHECK_TIMEOUT);
+			bool linksActive = false;
+			for (int i = 0; i < LINKCOUNT - 1; i++) {
+				linksActive = linksActive || links[i].wanted
+					|| linkOpen[links[i].id];
+			}
+			if (linksActive) { //Take in data arriving on persistent links
+				emptyRxAndBuffer();
+			}
+			unsigned long sinceCheck = fsmMillis() - lastConnectionCheck;
+			bool autoCheck = doAutoConn && (sinceCheck > CONNCHECK_TIMEOUT);
+			// An unread response for getResponse() only holds the queue for
+			// a while, so sketches that never read responses keep working
+			bool unread = responseReady
+				&& fsmMillis() - responseTime < RESPONSE_HOLD_TIMEOUT;
+			volatile Request *next = NULL;
+			if (connected && !responseHeld && !unread
+					&& completionCount < COMPLETIONQUEUESIZE) {
+				next = nextRequest();
+			}
+			if (next != NULL && next->priority != PRIORITY_BULK
+					&& sinceCheck <= CONNCHECK_TIMEOUT + CONNCHECK_MAXDEFER) {
+				autoCheck = false; // Let urgent traffic go ahead of the check
+			}
 			if (ssid[0] != '\0' && (newNetworkInfo || autoCheck)) {
 				// If we have an SSID, and it's new (or it's time to refresh),
 				// then check network connection and reconnect if needed
 				emptyRxAndBuffer();
-				wifiSerial.println(AT_CIPSTATUS);
-				timeoutStart = millis();
+				wifiTx.println(AT_CIPSTATUS);
+				timeoutStart = fsmMillis();
 				newNetworkInfo = false;
 				state = CIPSTATUS;
-			} else if (connected && hasRequest) { // Process the request
+			} else if (!muxReady) { // Needed before any connection is opened
+				emptyRxAndBuffer();
+				wifiTx.println(AT_CIPMUX);
+				timeoutStart = fsmMillis();
+				state = CIPMUX;
+			} else if ((next == NULL || next->priority != PRIORITY_ALARM)
+					&& serviceLinks()) { // Persistent link traffic was sent
+			} else if ((next == NULL || next->priority != PRIORITY_ALARM)
+					&& selectCommand()) { // Run a queued custom command
+				emptyRxAndBuffer();
+				wifiTx.println((char *)command_p->command);
+				timeoutStart = fsmMillis();
+				state = CUSTOMCOMMAND;
+			} else if (next == NULL && connected && networkCount > 0
+					&& serviceRoaming()) { // Check the signal between requests
+			} else if (next != NULL) { // Process the next queued request
+				request_p = next;
+				requestActive = true;
 				emptyRxAndBuffer();
-				wifiSerial.print(AT_CIPSTART);
-				wifiSerial.print("\"");
-				wifiSerial.print((char *)request_p->domain);
-				wifiSerial.print("\",");
-				wifiSerial.println(request_p->port);
-				timeoutStart = millis();
-				responseReady = false;
+				wifiTx.print(AT_CIPSTART);
+				wifiTx.print(HTTP_LINK);
+				wifiTx.print(AT_TCP);
+				wifiTx.print("\"");
+				wifiTx.print((char *)request_p->domain);
+				wifiTx.print("\",");
+				wifiTx.println(request_p->port);
+				timeoutStart = fsmMillis();
+				requestStart = fsmMillis();
+				responseReady = false; //Any unread response is overwritten
+				httpStatus = 0;
 				state = CIPSTART;
 			}
 			}	
@@ -398,11 +1684,11 @@ void ESP8266::processInterrupt() {
 					if (serialYes) {
 						Serial.println("Couldn't determine connection status");
 					}
-					lastConnectionCheck = millis();
+					lastConnectionCheck = fsmMillis();
 					connected = false;
 					state = IDLE;
 				} else if (status == 2 || status == 3 || status == 4) {
-					lastConnectionCheck = millis();
+					lastConnectionCheck = fsmMillis();
 					connected = true;
 					state = IDLE; // Connection ok, return to idle
 				} else {
@@ -410,51 +1696,73 @@ void ESP8266::processInterrupt() {
 						Serial.println("Not connected, attempting to connect");
 					}
 					connected = false;
-					emptyRxAndBuffer();	
-					wifiSerial.print(AT_CWJAP);
-					wifiSerial.print("\"");
-					wifiSerial.print((char *)ssid);
-					wifiSerial.print("\",\"");
-					wifiSerial.print((char *)password);
-					wifiSerial.println("\"");
-					timeoutStart = millis();
-					state = CWJAP;
+					dropLinks();
+					joinNetwork();
 				}
 			} else if (isTargetInResp(ERROR)) {
 				if (serialYes) {
 					Serial.println("\nCouldn't determine connection status");
 				}
-				lastConnectionCheck = millis();
+				lastConnectionCheck = fsmMillis();
 				connected = false;
 				state = IDLE;
-			} else if (millis() - timeoutStart > CIPSTATUS_TIMEOUT) {
+			} else if (fsmMillis() - timeoutStart > CIPSTATUS_TIMEOUT) {
 				if (serialYes) {
 					Serial.println("\nCIPSTATUS timed out");
 				}
-				lastConnectionCheck = millis();
+				lastConnectionCheck = fsmMillis();
 				connected = false;
 				state = IDLE;	// Hopefully it'll work next time
 			}	
 			break;
 		case CWJAP:
 			if (isTargetInResp(OK)) {
-				lastConnectionCheck = millis(); //Connection succeeded
+				lastConnectionCheck = fsmMillis(); //Connection succeeded
 				connected = true;
+				joinFailures = 0;
+				lastRssiCheck = fsmMillis() - RSSI_INTERVAL - 1; //Sample soon
 				state = IDLE;
 			} else if (isTargetInResp(FAIL)) {
-				lastConnectionCheck = millis();
+				lastConnectionCheck = fsmMillis();
+				nextNetwork();
 				state = IDLE;
 			} else if (isTargetInResp(ERROR)) { //This shouldn't happen
 				if (serialYes) {
 					Serial.println("\nMalformed CWJAP instruction");
 				}
-				lastConnectionCheck = millis();
+				lastConnectionCheck = fsmMillis();
+				nextNetwork();
 				state = IDLE;
-			} else if (millis() - timeoutStart > CWJAP_TIMEOUT) {
+			} else if (fsmMillis() - timeoutStart > CWJAP_TIMEOUT) {
 				if (serialYes) {
 					Serial.println("\nCWJAP instruction timed out");
 				}
-				lastConnectionCheck = millis();
+				lastConnectionCheck = fsmMillis();
+				nextNetwork();
+				state = IDLE;
+			}
+			break;
+		case CWJAPQUERY:
+			if (isTargetInResp(OK_LINE)) { //SSIDs could contain "OK"
+				char *loc = strstr((char *)inputBuffer, "+CWJAP:");
+				const char *field = (loc != NULL) ? atField(loc, 3) : NULL;
+				if (field != NULL) {
+					rssi = atoi(field);
+				}
+				state = IDLE;
+			} else if (isTargetInResp(ERROR)
+					|| fsmMillis() - timeoutStart > CWJAPQUERY_TIMEOUT) {
+				state = IDLE;
+			}
+			break;
+		case CWLAP:
+			if (isTargetInResp(OK_LINE)) { //SSIDs could contain "OK"
+				scanNetworks();
+			} else if (isTargetInResp(ERROR)
+					|| fsmMillis() - timeoutStart > CWLAP_TIMEOUT) {
+				if (serialYes) {
+					Serial.println("\nNetwork scan failed");
+				}
 				state = IDLE;
 			}
 			break;
@@ -470,44 +1778,55 @@ void ESP8266::processInterrupt() {
 				sprintf(portString, "%d", request_p->port);
 				sprintf(dataLenString, "%d", strlen((char *)request_p->data));
 				len += strlen(portString);
+				gzipRequest = gzip && !request_p->plain;
+				if (gzipRequest) {
+					len += strlen(HTTP_GZIP);
+				}
 				if (request_p->type==GET_REQ) {
 					len += HTTP_GET_FIXED_LEN;
 				} else {
 					len += strlen(dataLenString);
 					len += HTTP_POST_FIXED_LEN;
 				}
+				linkOpen[HTTP_LINK] = true;
 				emptyRxAndBuffer();
-				wifiSerial.print(AT_CIPSEND);
-				wifiSerial.println(len);
-				timeoutStart = millis();
+				wifiTx.print(AT_CIPSEND);
+				wifiTx.print(HTTP_LINK);
+				wifiTx.print(",");
+				wifiTx.println(len);
+				timeoutStart = fsmMillis();
 				state = CIPSEND;
 			} else if (isTargetInResp(ERROR)) {
 				if (serialYes) {
 					Serial.println("Could not make TCP connection");
 				}
-				hasRequest = request_p->auto_retry;
+				finishRequest(REQUEST_CONNECT_FAILED);
 				state = IDLE;
-			} else if (millis() - timeoutStart > CIPSTART_TIMEOUT) {
+			} else if (fsmMillis() - timeoutStart > CIPSTART_TIMEOUT) {
 				if (serialYes) {
 					Serial.println("TCP connection attempt timed out");
 				}
-				hasRequest = request_p->auto_retry;
+				finishRequest(REQUEST_CONNECT_FAILED);
 				state = IDLE;
 			}
 			break;
 		case CIPSEND:
 			if (isTargetInResp(OK_PROMPT)) {
 				emptyRxAndBuffer();
+				startHttpResponse();
 				if (request_p->type == GET_REQ) {
-					wifiSerial.print(HTTP_GET);
-					wifiSerial.print((char *)request_p->path);
-					wifiSerial.print("?");
-					wifiSerial.print((char *)request_p->data); //URL params
-					wifiSerial.print(HTTP_0);
-					wifiSerial.print((char *)request_p->domain);
-					wifiSerial.print(":");
-					wifiSerial.print(request_p->port);
-					wifiSerial.println(HTTP_END);
+					wifiTx.print(HTTP_GET);
+					wifiTx.print((char *)request_p->path);
+					wifiTx.print("?");
+					wifiTx.print((char *)request_p->data); //URL params
+					wifiTx.print(HTTP_0);
+					wifiTx.print((char *)request_p->domain);
+					wifiTx.print(":");
+					wifiTx.print(request_p->port);
+					if (gzipRequest) {
+						wifiTx.print(HTTP_GZIP);
+					}
+					wifiTx.println(HTTP_END);
 					if (serialYes) {
 						Serial.print(HTTP_GET);
 						Serial.print((char *)request_p->path);
@@ -517,20 +1836,26 @@ void ESP8266::processInterrupt() {
 						Serial.print((char *)request_p->domain);
 						Serial.print(":");
 						Serial.print(request_p->port);
+						if (gzipRequest) {
+							Serial.print(HTTP_GZIP);
+						}
 						Serial.println(HTTP_END);
 					}
 				} else {
-					wifiSerial.print(HTTP_POST);
-					wifiSerial.print((char *)request_p->path);
-					wifiSerial.print(HTTP_0);
-					wifiSerial.print((char *)request_p->domain);
-					wifiSerial.print(":");
-					wifiSerial.print(request_p->port);
-					wifiSerial.print(HTTP_1);
-					wifiSerial.print(strlen((char *)request_p->data));
-					wifiSerial.print(HTTP_2);
-					wifiSerial.print(HTTP_END);
-					wifiSerial.println((char *)request_p->data);
+					wifiTx.print(HTTP_POST);
+					wifiTx.print((char *)request_p->path);
+					wifiTx.print(HTTP_0);
+					wifiTx.print((char *)request_p->domain);
+					wifiTx.print(":");
+					wifiTx.print(request_p->port);
+					wifiTx.print(HTTP_1);
+					wifiTx.print(strlen((char *)request_p->data));
+					wifiTx.print(HTTP_2);
+					if (gzipRequest) {
+						wifiTx.print(HTTP_GZIP);
+					}
+					wifiTx.print(HTTP_END);
+					wifiTx.println((char *)request_p->data);
 					if (serialYes) {
 						Serial.print(HTTP_POST);
 						Serial.print((char *)request_p->path);
@@ -541,102 +1866,455 @@ void ESP8266::processInterrupt() {
 						Serial.print(HTTP_1);
 						Serial.print(strlen((char *)request_p->data));
 						Serial.print(HTTP_2);
+						if (gzipRequest) {
+							Serial.print(HTTP_GZIP);
+						}
 						Serial.print(HTTP_END);
 						Serial.println((char *)request_p->data);
 					}
 				}
-				timeoutStart = millis();
+				timeoutStart = fsmMillis();
 				state = DATAOUT;
 			} else if (isTargetInResp(ERROR)) {
 				if (serialYes) {
 					Serial.println("CIPSEND command failed");
 				}
-				wifiSerial.println(AT_CIPCLOSE);
-				hasRequest = request_p->auto_retry;
+				closeLink(HTTP_LINK);
+				finishRequest(REQUEST_SEND_FAILED);
 				state = IDLE;
-			} else if (millis() - timeoutStart > CIPSEND_TIMEOUT) {
+			} else if (fsmMillis() - timeoutStart > CIPSEND_TIMEOUT) {
 				if (serialYes) {
 					Serial.println("CIPSEND command timed out");
 				}
-				wifiSerial.println(AT_CIPCLOSE);
-				hasRequest = request_p->auto_retry;
+				closeLink(HTTP_LINK);
+				finishRequest(REQUEST_SEND_FAILED);
 				state = IDLE;
 			}
 			break;
 		case DATAOUT:
 			if (isTargetInResp(SEND_OK)) {
-				timeoutStart = millis();
+				timeoutStart = fsmMillis();
 				transmitCount++; // ESP8266 has successfully sent request out into the world
 				state = AWAITRESPONSE;
-				benchmark = millis();
+				benchmark = fsmMillis();
 			} else if (isTargetInResp(ERROR)) {
 				if (serialYes) {
 					Serial.println("Problem sending HTTP data");
 				}
-				wifiSerial.println(AT_CIPCLOSE);
-				hasRequest = request_p->auto_retry;
+				closeLink(HTTP_LINK);
+				finishRequest(REQUEST_SEND_FAILED);
 				state = IDLE;
-			} else if (millis() - timeoutStart > DATAOUT_TIMEOUT) {
+			} else if (fsmMillis() - timeoutStart > DATAOUT_TIMEOUT) {
 				if (serialYes) {
 					Serial.println("Timeout while confirming HTTP send");
 				}
-				wifiSerial.println(AT_CIPCLOSE);
-				hasRequest = request_p->auto_retry;
+				closeLink(HTTP_LINK);
+				finishRequest(REQUEST_SEND_FAILED);
 				state = IDLE;
 			}	
 			break;
 		case AWAITRESPONSE:
-			if (isTargetInResp(HTML_END)) {
-				benchmark = millis() - benchmark;
+			{
+			loadRx();
+			bool complete = httpState == HTTP_DONE || (httpState == HTTP_BODY
+					&& contentLength < 0 && !linkOpen[HTTP_LINK]);
+			if (httpState == HTTP_FAILED && gzipBody && inflater->tooFar
+					&& !request_p->plain && !request_p->cancelled) {
+				// Ask again for the body uncompressed
+				if (serialYes) {
+					Serial.println("Compressed response needs a larger window");
+				}
+				closeLink(HTTP_LINK);
+				request_p->plain = true;
+				requestActive = false;
+				httpState = HTTP_NONE;
+				state = IDLE;
+			} else if (httpState == HTTP_FAILED || (complete && gzipBody
+						&& inflater->state != INFLATE_DONE)) {
+				if (serialYes) {
+					Serial.println("Couldn't decode compressed response");
+				}
+				closeLink(HTTP_LINK);
+				finishRequest(REQUEST_DECODE_FAILED);
+				state = IDLE;
+			} else if (complete) {
+				benchmark = fsmMillis() - benchmark;
 				Serial.println(benchmark);
-				getStringFromResp(HTML_START, HTML_END, (char *)response);
+				// Hand back just the page for HTML, as older versions did
+				char *start = strstr((char *)response, HTML_START);
+				char *end = strstr((char *)response, HTML_END);
+				if (start != NULL && end != NULL && start < end) {
+					int len = end - start + strlen(HTML_END);
+					memmove((char *)response, start, len);
+					response[len] = '\0';
+					responseLength = len;
+				}
 				if (serialYes) {
 					Serial.println("Got HTTP response!");
 				}
-				wifiSerial.println(AT_CIPCLOSE);
-				hasRequest = false; //We're done with this request
-				responseReady = true;
+				closeLink(HTTP_LINK);
+				finishRequest(REQUEST_OK); //We're done with this request
 				receiveCount++;	// ESP8266 has successfully received a response from the web
 				state = IDLE;
-			} else if (millis() - timeoutStart > HTTP_TIMEOUT) {
+			} else if (!linkOpen[HTTP_LINK]) {
+				if (serialYes) {
+					Serial.println("Connection closed before HTTP response");
+				}
+				finishRequest(REQUEST_CLOSED);
+				state = IDLE;
+			} else if (fsmMillis() - timeoutStart > HTTP_TIMEOUT) {
 				if (serialYes) {
 					Serial.println("HTTP timeout");
 				}
-				wifiSerial.println(AT_CIPCLOSE);
-				hasRequest = request_p->auto_retry;
+				closeLink(HTTP_LINK);
+				finishRequest(REQUEST_TIMEOUT);
+				state = IDLE;
+			}
+			}
+			break;
+		case CUSTOMCOMMAND:
+			if (isTargetInResp((char *)command_p->terminator)) {
+				finishCommand(COMMAND_OK);
+				state = IDLE;
+			} else if (isTargetInResp(ERROR)) {
+				finishCommand(COMMAND_ERROR);
+				state = IDLE;
+			} else if (fsmMillis() - timeoutStart > command_p->timeout) {
+				if (serialYes) {
+					Serial.println("\nCustom command timed out");
+				}
+				finishCommand(COMMAND_TIMEOUT);
+				state = IDLE;
+			}
+			break;
+		case CIPMUX:
+			if (isTargetInResp(OK)) {
+				muxReady = true;
+				state = IDLE;
+			} else if (isTargetInResp(ERROR)) { //Already enabled, with a link up
+				muxReady = true;
+				state = IDLE;
+			} else if (fsmMillis() - timeoutStart > CIPMUX_TIMEOUT) {
+				if (serialYes) {
+					Serial.println("\nCIPMUX instruction timed out");
+				}
+				state = IDLE;
+			}
+			break;
+		case LINKSTART:
+			if ((isTargetInResp(ERROR) && isTargetInResp(ALREADY_CONNECTED))
+					|| isTargetInResp(OK)) {
+				linkOpen[link_p->id] = true;
+				linkOpened(link_p);
+				state = IDLE;
+			} else if (isTargetInResp(ERROR)) {
+				if (serialYes) {
+					Serial.println("Could not open persistent link");
+				}
+				state = IDLE; //Retried after LINK_RETRY_INTERVAL
+			} else if (fsmMillis() - timeoutStart > CIPSTART_TIMEOUT) {
+				if (serialYes) {
+					Serial.println("Persistent link attempt timed out");
+				}
+				state = IDLE;
+			}
+			break;
+		case LINKSEND:
+			if (isTargetInResp(OK_PROMPT) && (!linkOpen[link_p->id]
+						|| link_p->sendLength > link_p->txLength)) {
+				// Closed in the same batch as the prompt, tx was dropped
+				emptyRxAndBuffer();
+				link_p->sendLength = 0;
+				state = IDLE;
+			} else if (isTargetInResp(OK_PROMPT)) {
+				emptyRxAndBuffer();
+				int sent = link_p->sendLength;
+				for (int i = 0; i < sent; i++) {
+					wifiTx.write(link_p->tx[i]);
+				}
+				for (int i = sent; i < link_p->txLength; i++) {
+					link_p->tx[i - sent] = link_p->tx[i];
+				}
+				link_p->txLength -= sent;
+				timeoutStart = fsmMillis();
+				state = LINKDATAOUT;
+			} else if (isTargetInResp(ERROR)
+					|| fsmMillis() - timeoutStart > CIPSEND_TIMEOUT) {
+				if (serialYes) {
+					Serial.println("CIPSEND failed on persistent link");
+				}
+				closeLink(link_p->id);
+				linkClosed(link_p);
+				state = IDLE;
+			}
+			break;
+		case LINKDATAOUT:
+			if (isTargetInResp(SEND_OK)) {
+				state = IDLE;
+			} else if (isTargetInResp(ERROR) || isTargetInResp(FAIL)
+					|| fsmMillis() - timeoutStart > DATAOUT_TIMEOUT) {
+				if (serialYes) {
+					Serial.println("Problem sending on persistent link");
+				}
+				closeLink(link_p->id);
+				linkClosed(link_p);
 				state = IDLE;
 			}
 			break;
 	}
 }
 
-// Returns true if and only if target is in inputBuffer
-bool ESP8266::isTargetInResp(const char *target) {
-	loadRx();
-	return (strstr((char *)inputBuffer, target) != NULL);
+// Sample the signal strength, or scan for a better network if the link has
+// degraded.  Returns true if an AT command was sent and the FSM left IDLE.
+bool ESP8266::serviceRoaming() {
+	unsigned long now = fsmMillis();
+	bool degraded = rssi != 0 && rssi < ROAM_RSSI
+		&& linkLatency > ROAM_LATENCY;
+	if (degraded && networkIndex >= 0 && networkCount > 1
+			&& now - lastScan > ROAM_COOLDOWN) {
+		lastScan = now;
+		emptyRxAndBuffer();
+		wifiTx.println(AT_CWLAP);
+		timeoutStart = now;
+		state = CWLAP;
+		return true;
+	} else if (now - lastRssiCheck > RSSI_INTERVAL) {
+		lastRssiCheck = now;
+		emptyRxAndBuffer();
+		wifiTx.println(AT_CWJAPQUERY);
+		timeoutStart = now;
+		state = CWJAPQUERY;
+		return true;
+	}
+	return false;
 }
 
-// Looks for target in inputBuffer.  If target is found, loads all 
-// preceding characters (including the target itself) into result array and 
-// returns true, otherwise returns false.
-bool ESP8266::getStringFromResp(const char *target, char *result) {
-	loadRx();
-	char *loc = strstr((char *)inputBuffer, target);
-	if (loc != NULL) {
-		int numChars = loc - inputBuffer + strlen(target);
-		strncpy(result, (char *)inputBuffer, numChars);
-		result[numChars] = '\0'; //Make sure we null terminate the result	
-		return true;
+// Pick the strongest other candidate out of a finished AT+CWLAP scan, and
+// join it if it beats the current AP by ROAM_HYSTERESIS
+void ESP8266::scanNetworks() {
+	int best = -1;
+	int bestRssi = 0;
+	const char *line = strstr((char *)inputBuffer, "+CWLAP:(");
+	while (line != NULL) {
+		const char *name = atField(line, 1);
+		const char *level = atField(line, 2);
+		if (name != NULL && level != NULL && *name == '"') {
+			for (int i = 0; i < networkCount; i++) {
+				int len = strlen(networks[i].ssid);
+				int r = atoi(level);
+				if (i != networkIndex
+						&& strncmp(name + 1, networks[i].ssid, len) == 0
+						&& name[len + 1] == '"' && (best < 0 || r > bestRssi)) {
+					best = i;
+					bestRssi = r;
+				}
+			}
+		}
+		line = strstr(line + 1, "+CWLAP:(");
+	}
+	if (best >= 0 && (rssi == 0 || bestRssi >= rssi + ROAM_HYSTERESIS)) {
+		if (serialYes) {
+			Serial.println("\nRoaming to a stronger network");
+		}
+		useNetwork(best);
+		dropLinks();
+		connected = false;
+		joinNetwork();
 	} else {
-		return false;
+		state = IDLE;
 	}
 }
 
-// Looks for start and end targets in inputBuffer.  If both are found, and 
-// the start target is before the end target, this method loads the characters
-// in between (including both targets) into result array and returns true.
-// Otherwise, returns false. 
-bool ESP8266::getStringFromResp(const char*startTarget, const char*endTarget,
+// Send AT+CWJAP for the current ssid and password
+void ESP8266::joinNetwork() {
+	emptyRxAndBuffer();	
+	wifiTx.print(AT_CWJAP);
+	wifiTx.print("\"");
+	wifiTx.print((char *)ssid);
+	wifiTx.print("\",\"");
+	wifiTx.print((char *)password);
+	wifiTx.println("\"");
+	timeoutStart = fsmMillis();
+	state = CWJAP;
+}
+
+// After a failed join, move on to the next candidate.  Once each has failed
+// in turn, wait for the periodic connection check to try again.
+void ESP8266::nextNetwork() {
+	if (networkCount == 0 || networkIndex < 0) { //Keep connectWifi()'s network
+		return;
+	}
+	useNetwork((networkIndex + 1) % networkCount);
+	if (++joinFailures < networkCount) {
+		newNetworkInfo = true;
+	} else {
+		joinFailures = 0;
+	}
+}
+
+void ESP8266::useNetwork(int index) {
+	networkIndex = index;
+	strcpy((char *)ssid, networks[index].ssid);
+	strcpy((char *)password, networks[index].password);
+	rssi = 0;
+	linkLatency = 0;
+}
+
+// Find the start of a field in an AT response line like
+// +CWLAP:(3,"ssid",-60,...), skipping commas in quoted strings.  Returns NULL
+// if the line has fewer fields.
+const char *ESP8266::atField(const char *line, int field) {
+	const char *p = strchr(line, ':');
+	if (p == NULL) {
+		return NULL;
+	}
+	p++;
+	if (*p == '(') {
+		p++;
+	}
+	bool quoted = false;
+	while (field > 0) {
+		if (*p == '\0' || *p == '\r' || *p == '\n') {
+			return NULL;
+		} else if (*p == '"') {
+			quoted = !quoted;
+		} else if (*p == ',' && !quoted) {
+			field--;
+		}
+		p++;
+	}
+	return p;
+}
+
+// Returns the oldest queued request of the most urgent class, or NULL
+volatile ESP8266::Request *ESP8266::nextRequest() {
+	volatile Request *next = NULL;
+	for (int i = 0; i < REQUESTQUEUESIZE; i++) {
+		volatile Request *r = &requestQueue[i];
+		if (r->id != 0 && !r->spillError
+				&& (next == NULL || r->priority < next->priority
+					|| (r->priority == next->priority && r->id < next->id))) {
+			next = r;
+		}
+	}
+	return next;
+}
+
+// Point command_p at the oldest queued command, returns false if none
+bool ESP8266::selectCommand() {
+	volatile Command *next = NULL;
+	for (int i = 0; i < COMMANDQUEUESIZE; i++) {
+		volatile Command *cmd = &commandQueue[i];
+		if (cmd->id != 0 && !cmd->done
+				&& (next == NULL || cmd->id < next->id)) {
+			next = cmd;
+		}
+	}
+	if (next == NULL) {
+		return false;
+	}
+	command_p = next;
+	return true;
+}
+
+// Copy the command's response into the caller's buffer and hand it to poll()
+void ESP8266::finishCommand(int result) {
+	int len = strlen((char *)inputBuffer);
+	if (len > command_p->size - 1) {
+		len = command_p->size - 1;
+	}
+	strncpy(command_p->buffer, (char *)inputBuffer, len);
+	command_p->buffer[len] = '\0';
+	command_p->result = result;
+	command_p->elapsed = fsmMillis() - timeoutStart;
+	if (command_p->callback != NULL) {
+		command_p->done = true;
+	} else {
+		command_p->id = 0; //Nobody to tell, free the slot
+	}
+}
+
+// Wrap up the request being processed.  A failed auto_retry request stays
+// queued so that it's attempted again, otherwise its slot is freed and the
+// outcome is queued for poll() (or hasResponse() if it has no callback).
+void ESP8266::finishRequest(int error) {
+	requestActive = false;
+	httpState = HTTP_NONE;
+	if (error == REQUEST_OK) { // Running average for the roaming policy
+		linkLatency = (linkLatency * 3 + fsmMillis() - requestStart) / 4;
+	} else if (error == REQUEST_CONNECT_FAILED || error == REQUEST_SEND_FAILED
+			|| error == REQUEST_TIMEOUT) {
+		linkLatency = (linkLatency * 3 + HTTP_TIMEOUT) / 4;
+	}
+	if (request_p->cancelled) {
+		error = REQUEST_CANCELLED;
+	} else if (error != REQUEST_OK && request_p->auto_retry) {
+		return;
+	} else if (error != REQUEST_OK && store != NULL
+			&& request_p->callback != handleStoreResponse) {
+		request_p->spillError = error; //Keep the slot for poll() to store
+		return;
+	}
+	bool hasBody = (error == REQUEST_OK);
+	unsigned long latency = fsmMillis() - request_p->startTime;
+	volatile LatencyStats *stats = &latencyStats[request_p->priority];
+	if (hasBody) {
+		stats->count++;
+		stats->totalLatency += latency;
+		if (latency > stats->maxLatency) {
+			stats->maxLatency = latency;
+		}
+	} else {
+		stats->failed++;
+	}
+	if (request_p->callback != NULL) {
+		int i = (completionHead + completionCount) % COMPLETIONQUEUESIZE;
+		volatile Completion *c = &completions[i];
+		c->id = request_p->id;
+		c->callback = request_p->callback;
+		c->status = httpStatus;
+		c->error = error;
+		c->latency = latency;
+		c->hasBody = hasBody;
+		completionCount++;
+		if (hasBody) {
+			responseHeld = true;
+			responseReady = false;
+		}
+	} else if (hasBody) {
+		responseReady = true;
+		responseTime = fsmMillis();
+	}
+	request_p->id = 0;
+}
+
+// Returns true if and only if target is in inputBuffer
+bool ESP8266::isTargetInResp(const char *target) {
+	loadRx();
+	return (strstr((char *)inputBuffer, target) != NULL);
+}
+
+// Looks for target in inputBuffer.  If target is found, loads all 
+// preceding characters (including the target itself) into result array and 
+// returns true, otherwise returns false.
+bool ESP8266::getStringFromResp(const char *target, char *result) {
+	loadRx();
+	char *loc = strstr((char *)inputBuffer, target);
+	if (loc != NULL) {
+		int numChars = loc - inputBuffer + strlen(target);
+		strncpy(result, (char *)inputBuffer, numChars);
+		result[numChars] = '\0'; //Make sure we null terminate the result	
+		return true;
+	} else {
+		return false;
+	}
+}
+
+// Looks for start and end targets in inputBuffer.  If both are found, and 
+// the start target is before the end target, this method loads the characters
+// in between (including both targets) into result array and returns true.
+// Otherwise, returns false. 
+bool ESP8266::getStringFromResp(const char*startTarget, const char*endTarget,
 		char *result) {
 	loadRx();
 	char *startLoc = strstr((char *)inputBuffer, startTarget);
@@ -688,17 +2366,199 @@ int ESP8266::getStatusFromResp() {
 	return -1; //Could not find valid status int in inputBuffer
 }
 
-// Load wifi serial buffer into character array (inputBuffer)
+// All wifiSerial input goes through these so it can be traced or replayed
+int ESP8266::rxAvailable() {
+	if (replaying) {
+		if (nextTraceRecord(&rxCursor, false)
+				&& rxCursor.time <= replayClock) {
+			return rxCursor.remaining;
+		}
+		return 0;
+	}
+	return wifiSerial.available();
+}
+
+// Only call after rxAvailable() reported input
+char ESP8266::readRx() {
+	if (replaying) {
+		rxCursor.remaining--;
+		return rxCursor.data[rxCursor.pos++];
+	}
+	char c = wifiSerial.read();
+	if (tracing) {
+		traceByte(c, false);
+	}
+	return c;
+}
+
+size_t ESP8266::TraceTx::write(uint8_t b) {
+	ESP8266 *esp = _instance;
+	if (esp->replaying) {
+		if (esp->nextTraceRecord(&esp->txCursor, true)) {
+			if (esp->txCursor.data[esp->txCursor.pos] != b) {
+				esp->txMismatches++;
+			}
+			esp->txCursor.pos++;
+			esp->txCursor.remaining--;
+		} else {
+			esp->txMismatches++;
+		}
+		return 1;
+	}
+	if (esp->tracing) {
+		esp->traceByte(b, true);
+	}
+	return wifiSerial.write(b);
+}
+
+// The FSM's notion of time, simulated while replaying a trace
+unsigned long ESP8266::fsmMillis() {
+	return replaying ? replayClock : millis();
+}
+
+// Append a byte to the trace ring, extending the newest record if it's in
+// the same direction and millisecond
+void ESP8266::traceByte(uint8_t b, bool tx) {
+	unsigned long t = millis();
+	uint8_t dir = tx ? TRACE_TX : 0;
+	if (traceLast >= 0 && t == traceLastTime
+			&& (trace[traceLast] & TRACE_TX) == dir
+			&& (trace[traceLast] & TRACE_COUNT) < TRACE_COUNT) {
+		while (traceUsed + 1 > TRACESIZE) {
+			traceDropOldest();
+		}
+		if (traceLast >= 0) { //Newest record survived
+			trace[traceLast]++;
+			tracePut(b);
+			return;
+		}
+	}
+	uint8_t delta[5];
+	int deltaLen = 0;
+	unsigned long d = t - traceLastTime;
+	do {
+		delta[deltaLen] = d & 0x7F;
+		d >>= 7;
+		if (d != 0) {
+			delta[deltaLen] |= 0x80;
+		}
+		deltaLen++;
+	} while (d != 0);
+	while (traceUsed + deltaLen + 2 > TRACESIZE) {
+		traceDropOldest();
+	}
+	traceLast = traceHead;
+	traceLastTime = t;
+	tracePut(dir);
+	for (int i = 0; i < deltaLen; i++) {
+		tracePut(delta[i]);
+	}
+	tracePut(b);
+}
+
+void ESP8266::tracePut(uint8_t b) {
+	trace[traceHead] = b;
+	traceHead = (traceHead + 1) % TRACESIZE;
+	traceUsed++;
+}
+
+// Discard the oldest record in the trace ring
+void ESP8266::traceDropOldest() {
+	if (traceTail == traceLast) {
+		traceLast = -1;
+	}
+	int size = 1 + (trace[traceTail] & TRACE_COUNT) + 1;
+	int pos = (traceTail + 1) % TRACESIZE;
+	while (trace[pos] & 0x80) { //Skip the varint delta
+		size++;
+		pos = (pos + 1) % TRACESIZE;
+	}
+	traceTail = (traceTail + size) % TRACESIZE;
+	traceUsed -= size;
+}
+
+// Advance cursor to the next unread byte of a record in the given direction,
+// returns false if the trace has no more such bytes
+bool ESP8266::nextTraceRecord(TraceCursor *cursor, bool tx) {
+	while (cursor->remaining == 0) {
+		if (cursor->pos >= cursor->length) {
+			return false;
+		}
+		uint8_t header = cursor->data[cursor->pos++];
+		unsigned long delta = 0;
+		int shift = 0;
+		while (cursor->pos < cursor->length) {
+			uint8_t b = cursor->data[cursor->pos++];
+			delta |= (unsigned long)(b & 0x7F) << shift;
+			shift += 7;
+			if (!(b & 0x80)) {
+				break;
+			}
+		}
+		cursor->time += delta;
+		int count = (header & TRACE_COUNT) + 1;
+		if (count > cursor->length - cursor->pos) { //Truncated trace
+			count = cursor->length - cursor->pos;
+		}
+		if (((header & TRACE_TX) != 0) == tx) {
+			cursor->remaining = count;
+		} else {
+			cursor->pos += count;
+		}
+	}
+	return true;
+}
+
+// Load wifi serial buffer into character array (inputBuffer).  The payload
+// of +IPD packets is passed to payloadByte() instead, and each complete line
+// of text to lineEvent().
 void ESP8266::loadRx() {
 	int buffIndex = strlen((char *)inputBuffer);
-	while (wifiSerial.available() > 0 && buffIndex < BUFFERSIZE-1) {
-		char c = wifiSerial.read();
+	while (rxAvailable() > 0 && buffIndex < BUFFERSIZE-1) {
+		char c = readRx();
 		if (serialYes) {
 			Serial.print(c);
 		}
-		inputBuffer[buffIndex] = c;
-		inputBuffer[buffIndex+1] = '\0';
-		buffIndex++;
+		if (ipdRemaining > 0) {
+			ipdRemaining--;
+			payloadByte(ipdLink, c);
+		} else if (ipdHeader) { //Reading "<link>,<length>:"
+			if (c >= '0' && c <= '9') {
+				ipdLength = ipdLength * 10 + (c - '0');
+			} else if (c == ',') { //What we read was the link id
+				ipdLink = ipdLength;
+				ipdLength = 0;
+			} else {
+				ipdHeader = false;
+				if (c == ':') {
+					ipdRemaining = ipdLength;
+				}
+			}
+		} else if (c == IPD[ipdMatch] && IPD[ipdMatch + 1] == '\0') {
+			// Remove the start of "+IPD," which was loaded as text
+			buffIndex = (buffIndex > ipdMatch) ? buffIndex - ipdMatch : 0;
+			inputBuffer[buffIndex] = '\0';
+			ipdMatch = 0;
+			ipdHeader = true;
+			ipdLength = 0;
+			ipdLink = HTTP_LINK;
+			rxLineLength = 0;
+		} else {
+			if (c == IPD[ipdMatch]) {
+				ipdMatch++;
+			} else {
+				ipdMatch = (c == IPD[0]) ? 1 : 0;
+			}
+			inputBuffer[buffIndex] = c;
+			inputBuffer[buffIndex+1] = '\0';
+			buffIndex++;
+			if (c == '\n') {
+				lineEvent();
+				rxLineLength = 0;
+			} else if (c != '\r' && rxLineLength < RXLINESIZE - 1) {
+				rxLine[rxLineLength++] = c;
+			}
+		}
 	}
 	if (buffIndex >= BUFFERSIZE -1) {
 		if (serialYes) {
@@ -707,8 +2567,1392 @@ void ESP8266::loadRx() {
 	}
 }
 
+// Route a byte of TCP payload to whatever is expecting it
+void ESP8266::payloadByte(int link, char c) {
+	if (link == HTTP_LINK && httpState != HTTP_NONE) {
+		httpByte(c);
+	} else if (link == MQTT_LINK) {
+		mqttByte(c);
+	} else if (link == WS_LINK) {
+		wsByte(c);
+	}
+}
+
+// Act on connection status lines, which can arrive in the middle of any
+// other response
+void ESP8266::lineEvent() {
+	rxLine[rxLineLength] = '\0';
+	char *line = (char *)rxLine;
+	int link = HTTP_LINK;
+	if (line[0] >= '0' && line[0] <= '9' && line[1] == ',') { //"<link>,..."
+		link = line[0] - '0';
+		line += 2;
+	}
+	if (strcmp(line, CLOSED) == 0 && link < LINKCOUNT) {
+		linkOpen[link] = false;
+		if (link != HTTP_LINK) {
+			linkClosed(&links[link - 1]);
+		}
+	} else if (strcmp(line, READY) == 0) { //The ESP8266 restarted by itself
+		if (serialYes) {
+			Serial.println("\nESP8266 restarted");
+		}
+		dropLinks();
+		connected = false;
+		newNetworkInfo = true;
+	}
+}
+
+// Ask the ESP8266 to close a connection.  The reply is discarded along with
+// the rest of the input buffer.
+void ESP8266::closeLink(int link) {
+	wifiTx.print(AT_CIPCLOSE);
+	wifiTx.println(link);
+	linkOpen[link] = false;
+}
+
+// Forget every connection, after the ESP8266 has lost them all
+void ESP8266::dropLinks() {
+	muxReady = false;
+	linkOpen[HTTP_LINK] = false;
+	for (int i = 0; i < LINKCOUNT - 1; i++) {
+		if (linkOpen[links[i].id]) {
+			linkOpen[links[i].id] = false;
+			linkClosed(&links[i]);
+		}
+	}
+}
+
+// Open, feed and close persistent links from IDLE.  Returns true if an AT
+// command was sent and the FSM has left IDLE.
+bool ESP8266::serviceLinks() {
+	for (int i = 0; i < LINKCOUNT - 1; i++) {
+		volatile Link *link = &links[i];
+		if (!linkOpen[link->id]) {
+			if (link->wanted && connected
+					&& fsmMillis() - link->lastAttempt > LINK_RETRY_INTERVAL) {
+				link->lastAttempt = fsmMillis();
+				wifiTx.print(AT_CIPSTART);
+				wifiTx.print(link->id);
+				wifiTx.print(AT_TCP);
+				wifiTx.print("\"");
+				wifiTx.print((char *)link->host);
+				wifiTx.print("\",");
+				wifiTx.println(link->port);
+				link_p = link;
+				timeoutStart = fsmMillis();
+				state = LINKSTART;
+				return true;
+			}
+			continue;
+		}
+		if (link->id == MQTT_LINK) {
+			mqttTick();
+		} else if (link->id == WS_LINK) {
+			wsTick();
+		}
+		if (link->txLength > 0) {
+			link->sendLength = link->txLength;
+			wifiTx.print(AT_CIPSEND);
+			wifiTx.print(link->id);
+			wifiTx.print(",");
+			wifiTx.println(link->sendLength);
+			link_p = link;
+			timeoutStart = fsmMillis();
+			state = LINKSEND;
+			return true;
+		}
+		if (linkOpen[link->id] && (!link->wanted || link->restart)) {
+			link->restart = false;
+			link->lastAttempt = fsmMillis(); //Pace reconnections
+			closeLink(link->id);
+			linkClosed(link);
+		}
+	}
+	return false;
+}
+
+// Append data to a link's transmit buffer, all or nothing
+bool ESP8266::linkQueue(volatile Link *link, const uint8_t *data,
+		int length) {
+	if (link->txLength + length > LINK_TXSIZE) {
+		return false;
+	}
+	for (int i = 0; i < length; i++) {
+		link->tx[link->txLength + i] = data[i];
+	}
+	link->txLength += length;
+	return true;
+}
+
+// Start the protocol running over a newly opened link
+void ESP8266::linkOpened(volatile Link *link) {
+	link->txLength = 0;
+	if (link->id == MQTT_LINK) {
+		mqttConnect();
+	} else if (link->id == WS_LINK) {
+		wsHandshake();
+	}
+}
+
+// Clean up after a link closed, whichever end closed it
+void ESP8266::linkClosed(volatile Link *link) {
+	link->txLength = 0;
+	if (link->id == MQTT_LINK && mqttState != MQTT_DISCONNECTED) {
+		if (serialYes) {
+			Serial.println("MQTT connection closed");
+		}
+		mqttState = MQTT_DISCONNECTED;
+	} else if (link->id == WS_LINK && wsState != WS_CLOSED) {
+		if (serialYes) {
+			Serial.println("WebSocket closed");
+		}
+		wsState = WS_CLOSED;
+	}
+}
+
+// Queue CONNECT on a newly opened MQTT_LINK
+void ESP8266::mqttConnect() {
+	uint8_t packet[16 + MQTT_IDSIZE + 2 * MQTT_USERSIZE];
+	int remaining = 10 + 2 + strlen((char *)mqttClientId);
+	uint8_t flags = 0x02; //Clean session
+	if (mqttUsername[0] != '\0') {
+		flags |= 0x80;
+		remaining += 2 + strlen((char *)mqttUsername);
+		if (mqttPassword[0] != '\0') {
+			flags |= 0x40;
+			remaining += 2 + strlen((char *)mqttPassword);
+		}
+	}
+	int pos = mqttHeader(packet, 0x10, remaining); //CONNECT
+	pos += mqttString(packet + pos, "MQTT");
+	packet[pos++] = 4; //Protocol level 3.1.1
+	packet[pos++] = flags;
+	packet[pos++] = MQTT_KEEPALIVE >> 8;
+	packet[pos++] = MQTT_KEEPALIVE & 0xFF;
+	pos += mqttString(packet + pos, (char *)mqttClientId);
+	if (flags & 0x80) {
+		pos += mqttString(packet + pos, (char *)mqttUsername);
+	}
+	if (flags & 0x40) {
+		pos += mqttString(packet + pos, (char *)mqttPassword);
+	}
+	mqttRxState = 0;
+	mqttPingOutstanding = false;
+	mqttConnectStart = fsmMillis();
+	mqttState = MQTT_CONNECTING;
+	mqttSend(packet, pos);
+}
+
+// Keepalive, CONNACK timeout and QoS 1 retransmission, run from IDLE
+void ESP8266::mqttTick() {
+	unsigned long now = fsmMillis();
+	if (mqttState == MQTT_CONNECTING
+			&& now - mqttConnectStart > MQTT_CONNACK_TIMEOUT) {
+		if (serialYes) {
+			Serial.println("MQTT CONNACK timed out");
+		}
+		closeLink(MQTT_LINK);
+		linkClosed(&links[MQTT_LINK - 1]);
+		return;
+	}
+	if (mqttState != MQTT_CONNECTED) {
+		return;
+	}
+	if (mqttPingOutstanding && now - mqttPingSent > MQTT_KEEPALIVE * 1000UL) {
+		if (serialYes) {
+			Serial.println("MQTT broker stopped responding");
+		}
+		closeLink(MQTT_LINK);
+		linkClosed(&links[MQTT_LINK - 1]);
+		return;
+	}
+	if (!mqttPingOutstanding && now - mqttLastTx > MQTT_KEEPALIVE * 500UL) {
+		const uint8_t ping[] = {0xC0, 0x00}; //PINGREQ
+		if (mqttSend(ping, sizeof(ping))) {
+			mqttPingOutstanding = true;
+			mqttPingSent = now;
+		}
+	}
+	if (mqttInflightLength > 0
+			&& now - mqttInflightSent > MQTT_RETRY_TIMEOUT) {
+		mqttInflight[0] |= 0x08; //DUP
+		if (mqttSend((uint8_t *)mqttInflight, mqttInflightLength)) {
+			mqttInflightSent = now;
+		}
+	}
+}
+
+// Reassemble MQTT packets from the link's byte stream
+void ESP8266::mqttByte(uint8_t c) {
+	switch (mqttRxState) {
+		case 0: //Fixed header
+			mqttRxHeader = c;
+			mqttRxLength = 0;
+			mqttRxShift = 0;
+			mqttRxCount = 0;
+			mqttRxState = 1;
+			break;
+		case 1: //Remaining length, 7 bits at a time
+			mqttRxLength |= (c & 0x7F) << mqttRxShift;
+			mqttRxShift += 7;
+			if (!(c & 0x80)) {
+				if (mqttRxLength == 0) {
+					mqttPacket();
+					mqttRxState = 0;
+				} else {
+					mqttRxState = 2;
+				}
+			}
+			break;
+		case 2:
+			if (mqttRxCount < MQTT_PACKETSIZE) {
+				mqttRx[mqttRxCount] = c;
+			}
+			mqttRxCount++;
+			if (mqttRxCount >= mqttRxLength) {
+				mqttPacket();
+				mqttRxState = 0;
+			}
+			break;
+	}
+}
+
+// Handle a complete packet from the broker
+void ESP8266::mqttPacket() {
+	int n = (mqttRxCount < MQTT_PACKETSIZE) ? mqttRxCount : MQTT_PACKETSIZE;
+	switch (mqttRxHeader & 0xF0) {
+		case 0x20: //CONNACK
+			if (n >= 2 && mqttRx[1] == 0) {
+				if (serialYes) {
+					Serial.println("MQTT connected");
+				}
+				mqttState = MQTT_CONNECTED;
+				mqttLastTx = fsmMillis();
+				for (int i = 0; i < MQTT_MAXSUBS; i++) {
+					if (mqttSubs[i].callback != NULL) {
+						mqttSubscribe(i);
+					}
+				}
+				mqttInflightSent = fsmMillis() - MQTT_RETRY_TIMEOUT - 1;
+			} else {
+				if (serialYes) {
+					Serial.println("MQTT connection refused");
+				}
+				mqttState = MQTT_DISCONNECTED;
+				links[MQTT_LINK - 1].restart = true; //Closed from IDLE
+			}
+			break;
+		case 0x30: //PUBLISH
+			{
+			int qos = (mqttRxHeader >> 1) & 0x03;
+			if (n < 2) {
+				break;
+			}
+			int topicLength = (mqttRx[0] << 8) | mqttRx[1];
+			int pos = 2 + topicLength + (qos > 0 ? 2 : 0);
+			if (pos > n) {
+				break;
+			}
+			int i = 0;
+			while (i < MQTT_INBOXSIZE && mqttInbox[i].full) {
+				i++;
+			}
+			if (i < MQTT_INBOXSIZE) {
+				volatile MqttMessage *m = &mqttInbox[i];
+				int t = (topicLength < MQTT_TOPICSIZE - 1) ?
+					topicLength : MQTT_TOPICSIZE - 1;
+				for (int j = 0; j < t; j++) {
+					m->topic[j] = mqttRx[2 + j];
+				}
+				m->topic[t] = '\0';
+				m->length = n - pos;
+				for (int j = 0; j < m->length; j++) {
+					m->payload[j] = mqttRx[pos + j];
+				}
+				m->full = true;
+			} else if (serialYes) {
+				Serial.println("MQTT inbox full, message dropped");
+			}
+			if (qos > 0) {
+				int id = 2 + topicLength;
+				uint8_t ack[] = {0x40, 0x02, mqttRx[id], mqttRx[id + 1]};
+				mqttSend(ack, sizeof(ack)); //PUBACK
+			}
+			}
+			break;
+		case 0x40: //PUBACK
+			if (n >= 2 && ((mqttRx[0] << 8) | mqttRx[1]) == mqttInflightId) {
+				mqttInflightLength = 0;
+			}
+			break;
+		case 0x90: //SUBACK
+			if (n >= 3 && mqttRx[2] == 0x80 && serialYes) {
+				Serial.println("MQTT subscription refused");
+			}
+			break;
+		case 0xD0: //PINGRESP
+			mqttPingOutstanding = false;
+			break;
+	}
+}
+
+// Send SUBSCRIBE for one of mqttSubs.  Timer must be disabled or in ISR.
+void ESP8266::mqttSubscribe(int index) {
+	uint8_t packet[MQTT_TOPICSIZE + 8];
+	int remaining = 2 + 2 + strlen(mqttSubs[index].filter) + 1;
+	int pos = mqttHeader(packet, 0x82, remaining);
+	int id = mqttPacketId();
+	packet[pos++] = id >> 8;
+	packet[pos++] = id & 0xFF;
+	pos += mqttString(packet + pos, mqttSubs[index].filter);
+	packet[pos++] = mqttSubs[index].qos;
+	mqttSend(packet, pos);
+}
+
+// Queue a packet on MQTT_LINK.  Returns false if there's no room.
+bool ESP8266::mqttSend(const uint8_t *packet, int length) {
+	if (!linkQueue(&links[MQTT_LINK - 1], packet, length)) {
+		if (serialYes) {
+			Serial.println("MQTT transmit buffer full");
+		}
+		return false;
+	}
+	mqttLastTx = fsmMillis();
+	return true;
+}
+
+int ESP8266::mqttPacketId() {
+	int id = mqttNextPacketId;
+	mqttNextPacketId = (id == 0xFFFF) ? 1 : id + 1;
+	return id;
+}
+
+// Write a fixed header with the given type and remaining length.  Returns
+// the number of bytes written.
+int ESP8266::mqttHeader(uint8_t *buf, uint8_t type, int remaining) {
+	int pos = 0;
+	buf[pos++] = type;
+	do {
+		uint8_t b = remaining & 0x7F;
+		remaining >>= 7;
+		buf[pos++] = remaining > 0 ? (b | 0x80) : b;
+	} while (remaining > 0);
+	return pos;
+}
+
+// Write a length-prefixed UTF-8 string.  Returns the number of bytes written.
+int ESP8266::mqttString(uint8_t *buf, const char *str) {
+	int len = strlen(str);
+	buf[0] = len >> 8;
+	buf[1] = len & 0xFF;
+	memcpy(buf + 2, str, len);
+	return len + 2;
+}
+
+// Queue the HTTP upgrade request on a newly opened WS_LINK
+void ESP8266::wsHandshake() {
+	static const char base64[] =
+		"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	volatile Link *link = &links[WS_LINK - 1];
+	uint8_t nonce[16];
+	for (int i = 0; i < 16; i += 4) {
+		uint32_t r = wsNextRandom();
+		nonce[i] = r >> 24;
+		nonce[i + 1] = r >> 16;
+		nonce[i + 2] = r >> 8;
+		nonce[i + 3] = r;
+	}
+	char key[25];
+	int k = 0;
+	for (int i = 0; i < 16; i += 3) {
+		uint32_t v = (uint32_t)nonce[i] << 16;
+		v |= (i + 1 < 16) ? nonce[i + 1] << 8 : 0;
+		v |= (i + 2 < 16) ? nonce[i + 2] : 0;
+		key[k++] = base64[(v >> 18) & 0x3F];
+		key[k++] = base64[(v >> 12) & 0x3F];
+		key[k++] = (i + 1 < 16) ? base64[(v >> 6) & 0x3F] : '=';
+		key[k++] = (i + 2 < 16) ? base64[v & 0x3F] : '=';
+	}
+	key[k] = '\0';
+	char portString[8];
+	sprintf(portString, "%d", link->port);
+	const char *parts[] = {HTTP_GET, (char *)wsPath, HTTP_0,
+		(char *)link->host, ":", portString, WS_UPGRADE, key, WS_VERSION};
+	for (unsigned int i = 0; i < sizeof(parts) / sizeof(parts[0]); i++) {
+		linkQueue(link, (const uint8_t *)parts[i], strlen(parts[i]));
+	}
+	wsRxState = WS_RX_HANDSHAKE;
+	wsStatusLength = 0;
+	wsHeaderMatch = 0;
+	wsSlot = -1;
+	wsPingOutstanding = false;
+	wsConnectStart = fsmMillis();
+	wsState = WS_CONNECTING;
+}
+
+// Handshake timeout and keepalive pings, run from IDLE
+void ESP8266::wsTick() {
+	unsigned long now = fsmMillis();
+	if (wsState == WS_CONNECTING
+			&& now - wsConnectStart > WS_HANDSHAKE_TIMEOUT) {
+		if (serialYes) {
+			Serial.println("WebSocket handshake timed out");
+		}
+		closeLink(WS_LINK);
+		linkClosed(&links[WS_LINK - 1]);
+		return;
+	}
+	if (wsState != WS_OPEN) {
+		return;
+	}
+	if (wsPingOutstanding && now - wsPingSent > WS_PING_INTERVAL) {
+		if (serialYes) {
+			Serial.println("WebSocket server stopped responding");
+		}
+		closeLink(WS_LINK);
+		linkClosed(&links[WS_LINK - 1]);
+	} else if (!wsPingOutstanding && now - wsLastRx > WS_PING_INTERVAL
+			&& wsFrame(0x9, NULL, 0)) { //Ping
+		wsPingOutstanding = true;
+		wsPingSent = now;
+	}
+}
+
+// Parse the upgrade response, then frames, from the link's byte stream
+void ESP8266::wsByte(uint8_t c) {
+	switch (wsRxState) {
+		case WS_RX_HANDSHAKE:
+			if (wsState != WS_CONNECTING) {
+				break; //Refused, waiting for the link to close
+			}
+			if (wsStatusLength < (int)sizeof(wsStatusLine) - 1) {
+				wsStatusLine[wsStatusLength++] = c;
+				wsStatusLine[wsStatusLength] = '\0';
+			}
+			if (c == HTTP_END[wsHeaderMatch]) {
+				wsHeaderMatch++;
+			} else {
+				wsHeaderMatch = (c == HTTP_END[0]) ? 1 : 0;
+			}
+			if (HTTP_END[wsHeaderMatch] == '\0') { //End of the headers
+				if (strncmp((char *)wsStatusLine, WS_ACCEPTED,
+							strlen(WS_ACCEPTED)) == 0) {
+					if (serialYes) {
+						Serial.println("WebSocket connected");
+					}
+					wsLastRx = fsmMillis();
+					wsState = WS_OPEN;
+					wsRxState = WS_RX_OPCODE;
+				} else {
+					if (serialYes) {
+						Serial.println("WebSocket upgrade refused");
+					}
+					wsState = WS_CLOSED;
+					links[WS_LINK - 1].restart = true; //Closed from IDLE
+				}
+			}
+			break;
+		case WS_RX_OPCODE:
+			wsRxFin = c & 0x80;
+			wsRxOpcode = c & 0x0F;
+			wsRxState = WS_RX_LENGTH;
+			break;
+		case WS_RX_LENGTH:
+			wsRxMasked = c & 0x80;
+			wsRxLength = c & 0x7F;
+			if (wsRxLength >= 126) {
+				wsRxLengthBytes = (wsRxLength == 126) ? 2 : 8;
+				wsRxLength = 0;
+				wsRxState = WS_RX_EXTLENGTH;
+			} else {
+				wsFrameStart();
+			}
+			break;
+		case WS_RX_EXTLENGTH:
+			wsRxLength = (wsRxLength << 8) | c;
+			if (--wsRxLengthBytes == 0) {
+				wsFrameStart();
+			}
+			break;
+		case WS_RX_MASK:
+			wsRxMask[wsRxCount++] = c;
+			if (wsRxCount == 4) {
+				wsRxCount = 0;
+				wsRxState = WS_RX_PAYLOAD;
+				if (wsRxLength == 0) {
+					wsFrameEnd();
+				}
+			}
+			break;
+		case WS_RX_PAYLOAD:
+			if (wsRxMasked) {
+				c ^= wsRxMask[wsRxCount & 3];
+			}
+			if (wsRxOpcode >= 0x8) { //Control frames can't be fragmented
+				if (wsControlLength < WS_CONTROLSIZE) {
+					wsControl[wsControlLength++] = c;
+				}
+			} else if (wsSlot >= 0) {
+				volatile WsMessage *m = &wsInbox[wsSlot];
+				if (m->length < WS_MESSAGESIZE) {
+					m->data[m->length++] = c;
+				}
+			}
+			if (++wsRxCount == wsRxLength) {
+				wsFrameEnd();
+			}
+			break;
+	}
+}
+
+// A frame header has been read
+void ESP8266::wsFrameStart() {
+	wsRxCount = 0;
+	if (wsRxOpcode >= 0x8) {
+		wsControlLength = 0;
+	} else if (wsRxOpcode != 0x0) { //First frame of a message
+		wsSlot = 0;
+		while (wsSlot < WS_INBOXSIZE && wsInbox[wsSlot].full) {
+			wsSlot++;
+		}
+		if (wsSlot < WS_INBOXSIZE) {
+			wsInbox[wsSlot].length = 0;
+			wsInbox[wsSlot].binary = wsRxOpcode == 0x2;
+		} else {
+			if (serialYes) {
+				Serial.println("WebSocket inbox full, message dropped");
+			}
+			wsSlot = -1;
+		}
+	}
+	if (wsRxMasked) {
+		wsRxState = WS_RX_MASK;
+	} else {
+		wsRxState = WS_RX_PAYLOAD;
+		if (wsRxLength == 0) {
+			wsFrameEnd();
+		}
+	}
+}
+
+// A frame's payload has been read
+void ESP8266::wsFrameEnd() {
+	wsRxState = WS_RX_OPCODE;
+	wsLastRx = fsmMillis();
+	wsPingOutstanding = false; //Anything received shows the server is there
+	switch (wsRxOpcode) {
+		case 0x8: //Close, echo the status code back
+			if (wsState == WS_OPEN) {
+				wsFrame(0x8, (uint8_t *)wsControl,
+						wsControlLength < 2 ? wsControlLength : 2);
+				wsState = WS_CLOSED;
+				links[WS_LINK - 1].restart = true; //Closed from IDLE
+			}
+			break;
+		case 0x9: //Ping
+			wsFrame(0xA, (uint8_t *)wsControl, wsControlLength); //Pong
+			break;
+		case 0xA: //Pong
+			break;
+		default: //Text, binary or continuation
+			if (wsRxFin && wsSlot >= 0) {
+				volatile WsMessage *m = &wsInbox[wsSlot];
+				m->data[m->length] = '\0';
+				m->full = true;
+				wsSlot = -1;
+			}
+			break;
+	}
+}
+
+// Queue a masked frame on WS_LINK.  Returns false if there's no room.
+bool ESP8266::wsFrame(uint8_t opcode, const uint8_t *data, int length) {
+	volatile Link *link = &links[WS_LINK - 1];
+	int header = (length < 126) ? 6 : 8;
+	if (length > 0xFFFF || link->txLength + header + length > LINK_TXSIZE) {
+		if (serialYes) {
+			Serial.println("WebSocket transmit buffer full");
+		}
+		return false;
+	}
+	volatile uint8_t *p = link->tx + link->txLength;
+	*p++ = 0x80 | opcode; //Always a final frame
+	if (length < 126) {
+		*p++ = 0x80 | length;
+	} else {
+		*p++ = 0x80 | 126;
+		*p++ = length >> 8;
+		*p++ = length & 0xFF;
+	}
+	uint32_t r = wsNextRandom();
+	uint8_t mask[4] = {(uint8_t)(r >> 24), (uint8_t)(r >> 16),
+		(uint8_t)(r >> 8), (uint8_t)r};
+	for (int i = 0; i < 4; i++) {
+		*p++ = mask[i];
+	}
+	for (int i = 0; i < length; i++) {
+		*p++ = data[i] ^ mask[i & 3];
+	}
+	link->txLength += header + length;
+	return true;
+}
+
+// xorshift32, plenty for masking keys
+uint32_t ESP8266::wsNextRandom() {
+	uint32_t x = wsRandom;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	wsRandom = x;
+	return x;
+}
+
+// Match a topic against a filter with '+' and '#' wildcards
+bool ESP8266::mqttTopicMatches(const char *filter, const char *topic) {
+	while (*filter != '\0') {
+		if (*filter == '#') {
+			return true;
+		} else if (*filter == '+') {
+			while (*topic != '\0' && *topic != '/') {
+				topic++;
+			}
+			filter++;
+		} else if (*filter == *topic) {
+			filter++;
+			topic++;
+		} else if (*topic == '\0' && filter[0] == '/' && filter[1] == '#') {
+			return true; //"a/#" also matches "a"
+		} else {
+			return false;
+		}
+	}
+	return *topic == '\0';
+}
+
+// Reset the HTTP parser for the response to the request about to be sent
+void ESP8266::startHttpResponse() {
+	httpState = HTTP_STATUSLINE;
+	httpLineLength = 0;
+	httpStatus = 0;
+	contentLength = -1;
+	bodyRemaining = 0;
+	chunked = false;
+	htmlEndMatch = 0;
+	gzipBody = false;
+	responseLength = 0;
+	response[0] = '\0';
+
+	jsonState = JSON_VALUE;
+	jsonDepth = 0;
+	jsonArrays = 0;
+	jsonPathLength = 0;
+	jsonEscape = false;
+	jsonSkip = 0;
+	jsonMatches = 0;
+	for (int i = 0; i < jsonFieldCount; i++) {
+		jsonFields[i].set = false;
+	}
+}
+
+// Incremental HTTP/1.1 response parser, handling both Content-Length and
+// chunked bodies.  Body bytes are passed on to bodyData().
+void ESP8266::httpByte(char c) {
+	switch (httpState) {
+		case HTTP_STATUSLINE:
+		case HTTP_HEADERS:
+		case HTTP_CHUNKSIZE:
+		case HTTP_CHUNKEND:
+			if (c == '\n') {
+				httpLineBuffer[httpLineLength] = '\0';
+				httpLine();
+				httpLineLength = 0;
+			} else if (c != '\r' && httpLineLength < HTTP_LINESIZE - 1) {
+				httpLineBuffer[httpLineLength++] = c;
+			}
+			break;
+		case HTTP_BODY:
+			bodyData(c);
+			if (contentLength >= 0 && --bodyRemaining <= 0) {
+				httpState = HTTP_DONE;
+			}
+			break;
+		case HTTP_CHUNKDATA:
+			bodyData(c);
+			if (--bodyRemaining <= 0 && httpState != HTTP_DONE) {
+				httpState = HTTP_CHUNKEND;
+			}
+			break;
+		default:
+			break;
+	}
+}
+
+// Handle a complete line of the status line, headers, or chunk framing
+void ESP8266::httpLine() {
+	char *line = (char *)httpLineBuffer;
+	switch (httpState) {
+		case HTTP_STATUSLINE:
+			if (strncmp(line, HTTP_VERSION, strlen(HTTP_VERSION)) == 0) {
+				char *loc = strchr(line, ' ');
+				httpStatus = (loc != NULL) ? atoi(loc + 1) : 0;
+				httpState = HTTP_HEADERS;
+			}
+			break;
+		case HTTP_HEADERS:
+			if (line[0] == '\0') { //End of headers
+				if (httpStatus >= 100 && httpStatus < 200) {
+					httpState = HTTP_STATUSLINE; //Interim response
+				} else if (chunked) {
+					httpState = HTTP_CHUNKSIZE;
+				} else if (contentLength == 0 || httpStatus == 204
+						|| httpStatus == 304) {
+					httpState = HTTP_DONE;
+				} else {
+					bodyRemaining = contentLength;
+					httpState = HTTP_BODY;
+				}
+			} else if (strncasecmp(line, CONTENT_LENGTH,
+						strlen(CONTENT_LENGTH)) == 0) {
+				contentLength = atol(line + strlen(CONTENT_LENGTH));
+			} else if (strncasecmp(line, TRANSFER_ENCODING,
+						strlen(TRANSFER_ENCODING)) == 0
+					&& strstr(line, CHUNKED) != NULL) {
+				chunked = true;
+			} else if (strncasecmp(line, CONTENT_ENCODING,
+						strlen(CONTENT_ENCODING)) == 0
+					&& strstr(line, GZIP) != NULL && inflater != NULL) {
+				gzipBody = true;
+				inflateStart();
+			}
+			break;
+		case HTTP_CHUNKSIZE:
+			bodyRemaining = strtol(line, NULL, 16);
+			httpState = (bodyRemaining > 0) ? HTTP_CHUNKDATA : HTTP_DONE;
+			break;
+		case HTTP_CHUNKEND:
+			httpState = HTTP_CHUNKSIZE;
+			break;
+		default:
+			break;
+	}
+}
+
+// Take a byte of the body as sent, inflating it if it's compressed
+void ESP8266::bodyData(char c) {
+	if (gzipBody) {
+		inflateByte(c);
+	} else {
+		bodyByte(c);
+	}
+}
+
+// Store a byte of the response body, and scan it for JSON fields
+void ESP8266::bodyByte(char c) {
+	if (responseLength < RESPONSESIZE - 1) {
+		response[responseLength++] = c;
+		response[responseLength] = '\0';
+	}
+	if (jsonFieldCount > 0) {
+		jsonByte(c);
+	}
+	// Without a length the body runs until the server closes the connection,
+	// but an HTML page is done at its closing tag
+	if (contentLength < 0 && !chunked && !gzipBody) {
+		if (c == HTML_END[htmlEndMatch]) {
+			htmlEndMatch++;
+			if (HTML_END[htmlEndMatch] == '\0') {
+				httpState = HTTP_DONE;
+			}
+		} else {
+			htmlEndMatch = (c == HTML_END[0]) ? 1 : 0;
+		}
+	}
+}
+
+// Reset the inflater for a new gzip body
+void ESP8266::inflateStart() {
+	inflater->state = INFLATE_HEADER;
+	inflater->headerPos = 0;
+	inflater->headerFlags = 0;
+	inflater->huffman = NULL;
+	inflater->total = 0;
+	inflater->tooFar = false;
+}
+
+// Incremental gzip inflater.  Headers, stored blocks and the trailer are
+// read a byte at a time; compressed blocks are fed through a bit at a time,
+// so decoding never has to wait for more input than has arrived.
+void ESP8266::inflateByte(uint8_t c) {
+	Inflater *z = inflater;
+	switch (z->state) {
+		case INFLATE_HEADER:
+			inflateHeaderByte(c);
+			return;
+		case INFLATE_STORED: //LEN then NLEN, little endian
+			z->value |= (unsigned int)c << (8 * z->count);
+			if (++z->count == 4) {
+				z->skip = z->value & 0xFFFF;
+				if ((z->value >> 16) != (~z->value & 0xFFFF)) {
+					inflateFail();
+				} else if (z->skip == 0) {
+					inflateBlockEnd();
+				} else {
+					z->state = INFLATE_STOREDDATA;
+				}
+			}
+			return;
+		case INFLATE_STOREDDATA:
+			inflateOut(c);
+			if (--z->skip == 0) {
+				inflateBlockEnd();
+			}
+			return;
+		case INFLATE_TRAILER:
+			if (++z->count == 8) {
+				z->state = INFLATE_DONE;
+				if (contentLength < 0 && !chunked) {
+					httpState = HTTP_DONE; //Nothing else marks the end
+				}
+			}
+			return;
+		case INFLATE_DONE:
+		case INFLATE_FAILED:
+			return;
+		default:
+			break;
+	}
+	for (int i = 0; i < 8; i++) {
+		inflateBit((c >> i) & 1);
+		if (z->state == INFLATE_STORED || z->state == INFLATE_TRAILER
+				|| z->state == INFLATE_FAILED) {
+			break; //These start on a byte boundary
+		}
+	}
+}
+
+// Check the fixed gzip header, then skip the optional fields flagged in it
+void ESP8266::inflateHeaderByte(uint8_t c) {
+	Inflater *z = inflater;
+	if (z->headerPos < 10) {
+		if ((z->headerPos == 0 && c != 0x1F) || (z->headerPos == 1 && c != 0x8B)
+				|| (z->headerPos == 2 && c != 8)) { //Deflate is the only method
+			inflateFail();
+			return;
+		}
+		if (z->headerPos == 3) {
+			z->headerFlags = c & 0x1E;
+		}
+		z->headerPos++;
+	} else if (z->headerFlags & 0x04) { //FEXTRA, a length then data
+		if (z->headerPos == 10) {
+			z->skip = c;
+			z->headerPos++;
+		} else if (z->headerPos == 11) {
+			z->skip |= c << 8;
+			z->headerPos++;
+			if (z->skip == 0) {
+				z->headerFlags &= ~0x04;
+				z->headerPos = 10;
+			}
+		} else if (--z->skip == 0) {
+			z->headerFlags &= ~0x04;
+			z->headerPos = 10;
+		}
+	} else if (z->headerFlags & 0x08) { //FNAME, null terminated
+		if (c == 0) {
+			z->headerFlags &= ~0x08;
+		}
+	} else if (z->headerFlags & 0x10) { //FCOMMENT, null terminated
+		if (c == 0) {
+			z->headerFlags &= ~0x10;
+		}
+	} else if (z->headerFlags & 0x02) { //FHCRC, two bytes
+		if (++z->headerPos == 12) {
+			z->headerFlags &= ~0x02;
+		}
+	}
+	if (z->headerPos >= 10 && z->headerFlags == 0) {
+		z->state = INFLATE_BLOCK;
+		inflateBits(3);
+	}
+}
+
+// Feed one bit, least significant first, to the current read
+void ESP8266::inflateBit(int bit) {
+	Inflater *z = inflater;
+	if (z->huffman != NULL) { //Codes are packed most significant bit first
+		Huffman *h = z->huffman;
+		z->code |= bit;
+		z->codeLength++;
+		int count = h->count[z->codeLength];
+		if (z->code - count < z->first) {
+			z->huffman = NULL;
+			inflateValue(h->symbol[z->index + (z->code - z->first)]);
+		} else if (z->codeLength == 15) {
+			inflateFail();
+		} else {
+			z->index += count;
+			z->first = (z->first + count) << 1;
+			z->code <<= 1;
+		}
+	} else {
+		z->value |= bit << z->got;
+		if (++z->got == z->need) {
+			inflateValue(z->value);
+		}
+	}
+}
+
+// Read need bits as a number, then pass it to inflateValue()
+void ESP8266::inflateBits(int need) {
+	Inflater *z = inflater;
+	z->need = need;
+	z->got = 0;
+	z->value = 0;
+	if (need == 0) {
+		inflateValue(0);
+	}
+}
+
+// Decode a symbol with h, then pass it to inflateValue()
+void ESP8266::inflateSymbol(Huffman *h) {
+	Inflater *z = inflater;
+	z->huffman = h;
+	z->code = 0;
+	z->codeLength = 0;
+	z->first = 0;
+	z->index = 0;
+}
+
+// Act on a complete number or symbol read in the current state
+void ESP8266::inflateValue(unsigned int v) {
+	Inflater *z = inflater;
+	switch (z->state) {
+		case INFLATE_BLOCK:
+			z->final = v & 1;
+			if ((v >> 1) == 0) { //Stored
+				z->count = 0;
+				z->value = 0;
+				z->state = INFLATE_STORED;
+			} else if ((v >> 1) == 1) { //Fixed codes
+				for (int i = 0; i < 288; i++) {
+					z->lengths[i] = (i < 144) ? 8 : (i < 256) ? 9 : (i < 280) ?
+						7 : 8;
+				}
+				inflateTable(&z->lengthCode, z->lengths, 288);
+				for (int i = 0; i < 30; i++) {
+					z->lengths[i] = 5;
+				}
+				inflateTable(&z->distanceCode, z->lengths, 30);
+				z->state = INFLATE_SYMBOL;
+				inflateSymbol(&z->lengthCode);
+			} else if ((v >> 1) == 2) { //Dynamic codes
+				z->state = INFLATE_TABLESIZES;
+				inflateBits(14);
+			} else {
+				inflateFail();
+			}
+			break;
+		case INFLATE_TABLESIZES:
+			z->literals = (v & 0x1F) + 257;
+			z->distances = ((v >> 5) & 0x1F) + 1;
+			z->codes = (v >> 10) + 4;
+			if (z->literals > 286 || z->distances > 30) {
+				inflateFail();
+				break;
+			}
+			memset(z->lengths, 0, 19);
+			z->count = 0;
+			z->state = INFLATE_CODELENGTHS;
+			inflateBits(3);
+			break;
+		case INFLATE_CODELENGTHS:
+			z->lengths[inflateOrder[z->count++]] = v;
+			if (z->count < z->codes) {
+				inflateBits(3);
+			} else if (inflateTable(&z->distanceCode, z->lengths, 19) != 0) {
+				inflateFail(); //Code length code must be complete
+			} else {
+				z->count = 0;
+				z->state = INFLATE_LENGTHS;
+				inflateSymbol(&z->distanceCode);
+			}
+			break;
+		case INFLATE_LENGTHS:
+			if (v < 16) {
+				z->lengths[z->count++] = v;
+			} else if (v == 16 && z->count == 0) {
+				inflateFail(); //Nothing to repeat
+				break;
+			} else {
+				z->repeat = v;
+				z->state = INFLATE_LENGTHREPEAT;
+				inflateBits(v == 16 ? 2 : v == 17 ? 3 : 7);
+				break;
+			}
+			// Fall through when a length was stored
+		case INFLATE_LENGTHREPEAT:
+			if (z->state == INFLATE_LENGTHREPEAT) {
+				int n = v + (z->repeat == 18 ? 11 : 3);
+				uint8_t length = (z->repeat == 16) ? z->lengths[z->count - 1] : 0;
+				if (z->count + n > z->literals + z->distances) {
+					inflateFail();
+					break;
+				}
+				while (n-- > 0) {
+					z->lengths[z->count++] = length;
+				}
+				z->state = INFLATE_LENGTHS;
+			}
+			if (z->count < z->literals + z->distances) {
+				inflateSymbol(&z->distanceCode);
+			} else if (z->lengths[256] == 0 || inflateTable(&z->lengthCode,
+						z->lengths, z->literals) < 0 || inflateTable(
+						&z->distanceCode, z->lengths + z->literals,
+						z->distances) < 0) {
+				inflateFail(); //No end of block code, or over-subscribed
+			} else {
+				z->state = INFLATE_SYMBOL;
+				inflateSymbol(&z->lengthCode);
+			}
+			break;
+		case INFLATE_SYMBOL:
+			if (v < 256) {
+				inflateOut(v);
+				inflateSymbol(&z->lengthCode);
+			} else if (v == 256) {
+				inflateBlockEnd();
+			} else if (v - 257 >= 29) {
+				inflateFail();
+			} else {
+				z->length = inflateLengthBase[v - 257];
+				z->state = INFLATE_LENGTHEXTRA;
+				inflateBits(inflateLengthExtra[v - 257]);
+			}
+			break;
+		case INFLATE_LENGTHEXTRA:
+			z->length += v;
+			z->state = INFLATE_DISTANCE;
+			inflateSymbol(&z->distanceCode);
+			break;
+		case INFLATE_DISTANCE:
+			if (v >= 30) {
+				inflateFail();
+			} else {
+				z->skip = inflateDistanceBase[v];
+				z->state = INFLATE_DISTEXTRA;
+				inflateBits(inflateDistanceExtra[v]);
+			}
+			break;
+		case INFLATE_DISTEXTRA:
+			{
+			unsigned int distance = z->skip + v;
+			if (distance > z->total) {
+				inflateFail(); //Before the start of the body
+				break;
+			} else if (distance > INFLATE_WINDOWSIZE) {
+				z->tooFar = true; //Valid, but older than our window
+				inflateFail();
+				break;
+			}
+			for (int i = 0; i < z->length; i++) {
+				inflateOut(z->window[(z->total - distance)
+						& (INFLATE_WINDOWSIZE - 1)]);
+			}
+			z->state = INFLATE_SYMBOL;
+			inflateSymbol(&z->lengthCode);
+			}
+			break;
+		default:
+			break;
+	}
+}
+
+void ESP8266::inflateBlockEnd() {
+	Inflater *z = inflater;
+	if (z->final) {
+		z->count = 0;
+		z->state = INFLATE_TRAILER;
+	} else {
+		z->state = INFLATE_BLOCK;
+		inflateBits(3);
+	}
+}
+
+// Pass a decoded byte on as body, remembering it for back references
+void ESP8266::inflateOut(uint8_t c) {
+	Inflater *z = inflater;
+	z->window[z->total & (INFLATE_WINDOWSIZE - 1)] = c;
+	z->total++;
+	bodyByte(c);
+}
+
+void ESP8266::inflateFail() {
+	inflater->state = INFLATE_FAILED;
+	inflater->huffman = NULL;
+	httpState = HTTP_FAILED;
+}
+
+// Build a canonical Huffman code from code lengths.  Returns 0 if the code
+// is complete, positive if incomplete, or negative if over-subscribed.
+int ESP8266::inflateTable(Huffman *h, const uint8_t *lengths, int n) {
+	uint16_t offsets[16];
+	for (int len = 0; len < 16; len++) {
+		h->count[len] = 0;
+	}
+	for (int i = 0; i < n; i++) {
+		h->count[lengths[i]]++;
+	}
+	if (h->count[0] == n) {
+		return 0; //No codes, which is fine if none are used
+	}
+	int left = 1;
+	for (int len = 1; len < 16; len++) {
+		left = (left << 1) - h->count[len];
+		if (left < 0) {
+			return left;
+		}
+	}
+	offsets[1] = 0;
+	for (int len = 1; len < 15; len++) {
+		offsets[len + 1] = offsets[len] + h->count[len];
+	}
+	for (int i = 0; i < n; i++) {
+		if (lengths[i] != 0) {
+			h->symbol[offsets[lengths[i]]++] = i;
+		}
+	}
+	return left;
+}
+
+// Incremental JSON tokenizer.  Tracks the path of the current value, and
+// stores scalar values whose path matches a registered field.
+void ESP8266::jsonByte(char c) {
+	bool space = (c == ' ' || c == '\t' || c == '\r' || c == '\n');
+	switch (jsonState) {
+		case JSON_STRINGVAL:
+		case JSON_KEY:
+			if (jsonSkip > 0) {
+				jsonSkip--;
+				return;
+			}
+			if (jsonEscape) {
+				jsonEscape = false;
+				if (c == 'n') {
+					c = '\n';
+				} else if (c == 't') {
+					c = '\t';
+				} else if (c == 'r') {
+					c = '\r';
+				} else if (c == 'b' || c == 'f') {
+					return;
+				} else if (c == 'u') { //Non-ASCII characters aren't decoded
+					c = '?';
+					jsonSkip = 4;
+				}
+			} else if (c == '\\') {
+				jsonEscape = true;
+				return;
+			} else if (c == '"') {
+				if (jsonState == JSON_KEY) {
+					jsonState = JSON_COLON;
+				} else {
+					jsonEndValue();
+					jsonState = (jsonDepth == 0) ? JSON_END : JSON_AFTER;
+				}
+				return;
+			}
+			if (jsonState == JSON_KEY) {
+				jsonPathAppend(c);
+			} else if (jsonMatches && jsonValueLength < JSON_VALUESIZE - 1) {
+				jsonValue[jsonValueLength++] = c;
+			}
+			break;
+		case JSON_LITERAL:
+			if (space || c == ',' || c == '}' || c == ']') {
+				jsonEndValue();
+				jsonState = (jsonDepth == 0) ? JSON_END : JSON_AFTER;
+				jsonByte(c); //Handle the delimiter
+			} else if (jsonMatches && jsonValueLength < JSON_VALUESIZE - 1) {
+				jsonValue[jsonValueLength++] = c;
+			}
+			break;
+		case JSON_VALUE:
+			if (space) {
+				//Skip whitespace
+			} else if (c == '{') {
+				jsonPush(false);
+			} else if (c == '[') {
+				jsonPush(true);
+			} else if (c == ']' && jsonDepth > 0) { //Empty array
+				jsonPop();
+			} else if (c == '"') {
+				jsonStartValue();
+				jsonState = JSON_STRINGVAL;
+			} else {
+				jsonStartValue();
+				jsonValue[jsonValueLength++] = c;
+				jsonState = JSON_LITERAL;
+			}
+			break;
+		case JSON_KEY_OR_END:
+			if (c == '"') {
+				jsonChildPath();
+				jsonState = JSON_KEY;
+			} else if (c == '}') {
+				jsonPop();
+			}
+			break;
+		case JSON_COLON:
+			if (c == ':') {
+				jsonState = JSON_VALUE;
+			}
+			break;
+		case JSON_AFTER:
+			if (jsonDepth <= 0) { //Not inside a container, not JSON
+				jsonState = JSON_END;
+			} else if (c == ',') {
+				int top = jsonDepth - 1;
+				if (jsonArrays & (1UL << top)) {
+					if (top < JSON_MAXDEPTH) {
+						jsonIndex[top]++;
+					}
+					jsonChildPath();
+					jsonState = JSON_VALUE;
+				} else {
+					jsonState = JSON_KEY_OR_END;
+				}
+			} else if (c == '}' || c == ']') {
+				jsonPop();
+			}
+			break;
+		default:
+			break;
+	}
+}
+
+// Open an object or array
+void ESP8266::jsonPush(bool array) {
+	if (jsonDepth >= 32) { //Can't track any deeper, give up on this body
+		jsonState = JSON_END;
+		return;
+	}
+	if (jsonDepth < JSON_MAXDEPTH) {
+		jsonBase[jsonDepth] = jsonPathLength;
+		jsonIndex[jsonDepth] = 0;
+	} else {
+		jsonPathLength = JSON_PATHSIZE; //Too deep to match
+	}
+	if (array) {
+		jsonArrays |= (1UL << jsonDepth);
+	} else {
+		jsonArrays &= ~(1UL << jsonDepth);
+	}
+	jsonDepth++;
+	if (array) {
+		jsonChildPath();
+		jsonState = JSON_VALUE;
+	} else {
+		jsonState = JSON_KEY_OR_END;
+	}
+}
+
+// Close the innermost object or array
+void ESP8266::jsonPop() {
+	if (jsonDepth <= 0) { //Unbalanced, give up on this body
+		jsonState = JSON_END;
+		return;
+	}
+	jsonDepth--;
+	if (jsonDepth < JSON_MAXDEPTH) {
+		jsonPathLength = jsonBase[jsonDepth];
+	}
+	jsonState = (jsonDepth == 0) ? JSON_END : JSON_AFTER;
+}
+
+// Set the path to the innermost container's path plus a separator, followed
+// by the array index if the container is an array.  Keys are appended by the
+// tokenizer as they're read.
+void ESP8266::jsonChildPath() {
+	int top = jsonDepth - 1;
+	if (top < 0 || top >= JSON_MAXDEPTH) {
+		return;
+	}
+	jsonPathLength = jsonBase[top];
+	if (jsonPathLength > 0) {
+		jsonPathAppend('.');
+	}
+	if (jsonArrays & (1UL << top)) {
+		char index[12];
+		sprintf(index, "%d", jsonIndex[top]);
+		for (int i = 0; index[i] != '\0'; i++) {
+			jsonPathAppend(index[i]);
+		}
+	}
+}
+
+void ESP8266::jsonPathAppend(char c) {
+	if (jsonPathLength < JSON_PATHSIZE - 1) {
+		jsonPath[jsonPathLength] = c;
+	}
+	jsonPathLength++;
+}
+
+// Note which fields the value about to be read belongs to
+void ESP8266::jsonStartValue() {
+	jsonMatches = 0;
+	jsonValueLength = 0;
+	if (jsonPathLength < JSON_PATHSIZE) {
+		jsonPath[jsonPathLength] = '\0';
+		for (int i = 0; i < jsonFieldCount; i++) {
+			if (strcmp(jsonFields[i].path, (char *)jsonPath) == 0) {
+				jsonMatches |= (1UL << i);
+			}
+		}
+	}
+}
+
+// Convert a complete value and store it in each field it matched
+void ESP8266::jsonEndValue() {
+	if (jsonMatches == 0) {
+		return;
+	}
+	char *value = (char *)jsonValue;
+	value[jsonValueLength] = '\0';
+	bool isNull = (jsonState == JSON_LITERAL && strcmp(value, "null") == 0);
+	bool isTrue = (strcmp(value, "true") == 0);
+	for (int i = 0; i < jsonFieldCount && !isNull; i++) {
+		if (!(jsonMatches & (1UL << i))) {
+			continue;
+		}
+		JsonField *f = &jsonFields[i];
+		switch (f->type) {
+			case JSON_INT:
+				*(long *)f->dest = isTrue ? 1 : atol(value);
+				break;
+			case JSON_FLOAT:
+				*(float *)f->dest = isTrue ? 1 : atof(value);
+				break;
+			case JSON_BOOL:
+				*(bool *)f->dest = isTrue || atof(value) != 0;
+				break;
+			case JSON_STRING:
+				strncpy((char *)f->dest, value, f->size - 1);
+				((char *)f->dest)[f->size - 1] = '\0';
+				break;
+		}
+		f->set = true;
+	}
+	jsonMatches = 0;
+}
+
+// Discard pending input, still passing along any +IPD payload
 void ESP8266::emptyRxAndBuffer() {
-	emptyRx();
 	inputBuffer[0] = '\0';
+	while (rxAvailable() > 0) {
+		loadRx();
+		inputBuffer[0] = '\0';
+	}
 }
 
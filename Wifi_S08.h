@@ -7,6 +7,10 @@
 // In order for the library to function properly, you will need to edit the 
 // file 'serial1.c' and change the value of the macro RX_BUFFER_SIZE from 64
 // to something larger, like 1024
+//
+// Response bodies are streamed as they arrive.  If you only need a few
+// fields from JSON responses, register them with addJsonField() and
+// RESPONSESIZE can be made much smaller; longer bodies are truncated.
 
 #ifndef Wifi_S08_H
 #define Wifi_S08_H
@@ -18,6 +22,12 @@
 #define GET 0
 #define POST 1
 
+// Request priority classes, most urgent first
+#define PRIORITY_ALARM 0
+#define PRIORITY_NORMAL 1
+#define PRIORITY_BULK 2
+#define PRIORITYCOUNT 3
+
 // Sizes of character arrays
 #define BUFFERSIZE 8192
 #define RESPONSESIZE 8192
@@ -27,6 +37,58 @@
 #define DOMAINSIZE 256
 #define PATHSIZE 256
 #define DATASIZE 1024
+#define REQUESTTEXTSIZE (DATASIZE + 256) //Packed strings of a queued request
+#define COMMANDSIZE 128
+#define TERMINATORSIZE 16
+#define RXLINESIZE 16 //Enough for connection status lines like "0,CLOSED"
+#define HTTP_LINESIZE 128 //Longest HTTP status or header line parsed
+#define JSONFIELDS 8
+#define JSON_PATHSIZE 64
+#define JSON_VALUESIZE 32 //Longer JSON strings are truncated
+#define JSON_MAXDEPTH 8 //Deeper values can't be matched
+#define INFLATE_WINDOWSIZE 4096 //Power of 2, longer back references refetch
+
+// The ESP8266 runs with multiple connections enabled, each with its own id
+#define HTTP_LINK 0
+#define MQTT_LINK 1
+#define WS_LINK 2
+#define LINKCOUNT 3
+#define LINK_TXSIZE 512 //Bytes queued for sending on a persistent link
+
+// MQTT client sizes
+#define MQTT_PACKETSIZE 512 //Longer received packets are truncated
+#define MQTT_IDSIZE 32
+#define MQTT_USERSIZE 32 //For both username and password
+#define MQTT_TOPICSIZE 64
+#define MQTT_MAXSUBS 4
+#define MQTT_INBOXSIZE 2 //Received messages awaiting poll()
+
+// WebSocket client sizes
+#define WS_MESSAGESIZE 256 //Longer received messages are truncated
+#define WS_INBOXSIZE 2 //Received messages awaiting poll()
+#define WS_CONTROLSIZE 125 //Largest control frame payload allowed
+
+// Roaming between networks added with addNetwork()
+#define NETWORKCOUNT 4
+#define RSSI_INTERVAL 30000 //Between signal strength samples, in ms
+#define ROAM_RSSI -75 //Scan for a better AP below this, in dBm
+#define ROAM_LATENCY 3000 //...with requests averaging above this, in ms
+#define ROAM_HYSTERESIS 8 //How many dB stronger another AP must be
+#define ROAM_COOLDOWN 120000 //Between scans, in ms
+
+// Store-and-forward pacing, in ms
+#define STORE_DRAIN_INTERVAL 1000 //Between stored requests being resent
+#define STORE_RETRY_INTERVAL 10000 //After a stored request fails again
+
+// Sizes of request bookkeeping queues
+#define REQUESTQUEUESIZE 4
+#define COMPLETIONQUEUESIZE 4
+#define COMMANDQUEUESIZE 2
+#define ENDPOINTCOUNT 8
+#define ALARM_QUEUE_LIMIT REQUESTQUEUESIZE
+#define NORMAL_QUEUE_LIMIT 2
+#define BULK_QUEUE_LIMIT 1
+#define TRACESIZE 4096
 
 // Timing constants
 #define INTERRUPT_MICROS 50000
@@ -37,12 +99,23 @@
 #define RST_TIMEOUT 7000
 #define RESTORE_TIMEOUT 7000
 #define CONNCHECK_TIMEOUT 10000
+#define CONNCHECK_MAXDEFER 20000 //How long traffic may postpone a check
+#define RESPONSE_HOLD_TIMEOUT 5000 //Before an unread response is overwritten
 #define CIPSTATUS_TIMEOUT 5000
 #define CWJAP_TIMEOUT 15000
+#define CWJAPQUERY_TIMEOUT 1000
+#define CWLAP_TIMEOUT 10000
 #define CIPSTART_TIMEOUT 15000
 #define CIPSEND_TIMEOUT 5000
 #define DATAOUT_TIMEOUT 5000
 #define HTTP_TIMEOUT 12000
+#define CIPMUX_TIMEOUT 1000
+#define LINK_RETRY_INTERVAL 5000 //Between attempts to open a persistent link
+#define MQTT_KEEPALIVE 60 //In seconds
+#define MQTT_CONNACK_TIMEOUT 10000
+#define MQTT_RETRY_TIMEOUT 10000 //Before resending an unacknowledged publish
+#define WS_HANDSHAKE_TIMEOUT 10000
+#define WS_PING_INTERVAL 30000 //Of silence before pinging the server
 
 // AT Commands, some of which require appended arguments
 #define AT_BASIC "AT"
@@ -53,9 +126,13 @@
 #define AT_CIPAPMAC "AT+CIPAPMAC?"
 #define AT_CIPSTATUS "AT+CIPSTATUS"
 #define AT_CWJAP "AT+CWJAP_DEF="
-#define AT_CIPSTART "AT+CIPSTART=\"TCP\","
+#define AT_CWJAPQUERY "AT+CWJAP?"
+#define AT_CWLAP "AT+CWLAP"
+#define AT_CIPMUX "AT+CIPMUX=1"
+#define AT_CIPSTART "AT+CIPSTART="
+#define AT_TCP ",\"TCP\","
 #define AT_CIPSEND "AT+CIPSEND="
-#define AT_CIPCLOSE "AT+CIPCLOSE"
+#define AT_CIPCLOSE "AT+CIPCLOSE="
 
 #define HTTP_POST "POST "
 #define HTTP_GET "GET "
@@ -63,6 +140,33 @@
 #define HTTP_1 "\r\nAccept:*/*\r\nContent-Length: "
 #define HTTP_2 "\r\nContent-Type: application/x-www-form-urlencoded"
 #define HTTP_END "\r\n\r\n"
+#define HTTP_GZIP "\r\nAccept-Encoding: gzip"
+#define HTTP_VERSION "HTTP/1."
+#define WS_UPGRADE "\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n\
+Sec-WebSocket-Key: "
+#define WS_VERSION "\r\nSec-WebSocket-Version: 13\r\n\r\n"
+#define WS_ACCEPTED "HTTP/1.1 101"
+
+// Request completion codes, passed as the error argument of a RequestCallback
+#define REQUEST_OK 0
+#define REQUEST_CONNECT_FAILED 1
+#define REQUEST_SEND_FAILED 2
+#define REQUEST_TIMEOUT 3
+#define REQUEST_CANCELLED 4
+#define REQUEST_CLOSED 5 //Connection closed before the response completed
+#define REQUEST_STORED 6 //Failed, but saved to the store to be resent
+#define REQUEST_DECODE_FAILED 7 //Compressed body couldn't be decoded
+
+// Types of values that can be extracted with addJsonField()
+#define JSON_INT 0 //long
+#define JSON_FLOAT 1 //float
+#define JSON_BOOL 2 //bool
+#define JSON_STRING 3 //char array of the size given
+
+// Custom command outcomes, passed to a CommandCallback
+#define COMMAND_OK 0 //Terminator received
+#define COMMAND_ERROR 1 //"ERROR" received instead of the terminator
+#define COMMAND_TIMEOUT 2
 
 //macros for length of boilerplate part of GET and POST requests
 //-3 offset to ignore null terminators, +4 offset for "?" and ":" and \r\n
@@ -70,11 +174,69 @@
 //-5 offset to ignore null terminators, +3 offset for ":", and /r/n
 #define HTTP_POST_FIXED_LEN sizeof(HTTP_POST)+sizeof(HTTP_0)+sizeof(HTTP_1)\
 	+sizeof(HTTP_2)+sizeof(HTTP_END)-5+3
+//-4 offset to ignore null terminators, +30 for ":", the port and the key
+#define WS_HANDSHAKE_FIXED_LEN sizeof(HTTP_GET)+sizeof(HTTP_0)\
+	+sizeof(WS_UPGRADE)+sizeof(WS_VERSION)-4+30
 
 
 #include <WString.h>
 #include <Arduino.h>
 
+// Called from poll() when a request finishes.  status is the HTTP status code
+// (0 if none was received), body is only valid for the duration of the call.
+typedef void (*RequestCallback)(int id, int status, const char *body,
+		int length, unsigned long latency, int error);
+
+// Called from poll() when a command queued with sendCommand() finishes.
+// response points at the caller's buffer; elapsed is measured from the moment
+// the command was written to the ESP8266.
+typedef void (*CommandCallback)(int id, int result, const char *response,
+		int length, unsigned long elapsed);
+
+// Per priority class request statistics
+struct LatencyStats {
+	unsigned long count; //Requests completed successfully
+	unsigned long failed; //Requests that failed or were cancelled
+	unsigned long rejected; //Requests refused because the class was full
+	unsigned long totalLatency; //Sum of successful request latencies, in ms
+	unsigned long maxLatency;
+};
+
+// Called from poll() for each received MQTT message matching a subscription
+typedef void (*MqttCallback)(const char *topic, const uint8_t *payload,
+		int length);
+
+// Called from poll() for each complete WebSocket message.  Text messages are
+// also NUL terminated.
+typedef void (*WebSocketCallback)(const char *message, int length,
+		bool binary);
+
+// Results of replaying a captured trace through the FSM
+struct ReplayStats {
+	unsigned long ticks; //Number of interrupts simulated
+	unsigned long duration; //Simulated time covered, in ms
+	unsigned long isrMicros; //Total time spent in the interrupt handler
+	unsigned long maxIsrMicros; //Longest single interrupt
+	int txMismatches; //Bytes sent that differ from the trace
+};
+
+// Byte addressable persistent storage for the store-and-forward log.
+// Unwritten bytes must read as 0xFF.
+class WifiStore {
+	public:
+		virtual int length() = 0;
+		virtual uint8_t read(int address) = 0;
+		virtual void write(int address, uint8_t value) = 0;
+};
+
+// WifiStore backed by the microcontroller's EEPROM
+class EEPROMStore : public WifiStore {
+	public:
+		virtual int length();
+		virtual uint8_t read(int address);
+		virtual void write(int address, uint8_t value);
+};
+
 class ESP8266 {
 	public:
 		ESP8266();
@@ -82,12 +244,58 @@ class ESP8266 {
 		void begin();
 		bool isConnected();
 		void connectWifi(String ssid, String password);
+		bool addNetwork(String ssid, String password);
+		void clearNetworks();
+		int getRSSI();
 		bool isBusy();
-		void sendRequest(int type, String domain, int port, String path, 
+		int sendRequest(int type, String domain, int port, String path, 
 				String data);
-		void sendRequest(int type, String domain, int port, String path,
+		int sendRequest(int type, String domain, int port, String path,
 				String data, bool auto_retry);
+		int sendRequest(int type, String domain, int port, String path,
+				String data, RequestCallback callback);
+		int sendRequest(int type, String domain, int port, String path,
+				String data, bool auto_retry, RequestCallback callback);
+		int sendPriorityRequest(int priority, int type, String domain,
+				int port, String path, String data, bool auto_retry,
+				RequestCallback callback);
+		int addEndpoint(int type, const char *domain, int port,
+				const char *path);
+		int sendEndpointRequest(int endpoint, String data,
+				RequestCallback callback);
+		int sendPriorityEndpointRequest(int priority, int endpoint,
+				String data, bool auto_retry, RequestCallback callback);
+		void setQueueLimit(int priority, int limit);
+		bool getLatencyStats(int priority, LatencyStats *stats);
+		void resetLatencyStats();
+		int addJsonField(String path, int type, void *dest, int size);
+		void clearJsonFields();
+		bool isJsonFieldSet(int index);
+		bool enableStore();
+		bool enableStore(WifiStore *store);
+		void disableStore();
+		int getStoredCount();
+		bool enableGzip();
+		void disableGzip();
+		void connectMqtt(String host, int port, String clientId);
+		void connectMqtt(String host, int port, String clientId,
+				String username, String password);
+		void disconnectMqtt();
+		bool isMqttConnected();
+		bool publishMqtt(String topic, String payload);
+		bool publishMqtt(String topic, const uint8_t *payload, int length,
+				int qos, bool retain);
+		bool subscribeMqtt(String filter, int qos, MqttCallback callback);
+		bool unsubscribeMqtt(String filter);
+		bool connectWebSocket(String host, int port, String path,
+				WebSocketCallback callback);
+		void disconnectWebSocket();
+		bool isWebSocketConnected();
+		bool sendWebSocket(String text);
+		bool sendWebSocket(const uint8_t *data, int length, bool binary);
+		bool cancelRequest(int id);
 		void clearRequest();
+		void poll();
 		int benchmark;
 		bool hasResponse();
 		String getResponse();
@@ -96,12 +304,19 @@ class ESP8266 {
 		bool restore();
 		bool reset();
 		String sendCustomCommand(String command, unsigned long timeout);
+		int sendCommand(String command, String terminator, char *buffer,
+				int size, unsigned long timeout, CommandCallback callback);
 		bool isAutoConn();
 		void setAutoConn(bool value);
 		int getTransmitCount();
 		void resetTransmitCount();
 		int getReceiveCount();
 		void resetReceiveCount();
+		bool startTrace();
+		void stopTrace();
+		int getTraceLength();
+		void dumpTrace();
+		bool replayTrace(const uint8_t *data, int length, ReplayStats *stats);
 
 	private:
 		static ESP8266 * _instance; //Static instance of this singleton class
@@ -110,6 +325,7 @@ class ESP8266 {
 		static char const READY[];
 		static char const OK[];
 		static char const OK_PROMPT[];
+		static char const OK_LINE[];
 		static char const SEND_OK[];
 		static char const ERROR[];
 		static char const FAIL[];
@@ -117,25 +333,231 @@ class ESP8266 {
 		static char const ALREADY_CONNECTED[];
 		static char const HTML_START[];
 		static char const HTML_END[];
+		static char const CLOSED[];
+		static char const IPD[];
+		static char const CONTENT_LENGTH[];
+		static char const TRANSFER_ENCODING[];
+		static char const CHUNKED[];
+		static char const CONTENT_ENCODING[];
+		static char const GZIP[];
 
 		// Private enums and structs
 		enum RequestType {GET_REQ, POST_REQ};
 		struct Request {
-			volatile char domain[DOMAINSIZE];
-			volatile char path[PATHSIZE];
-			volatile char data[DATASIZE];
+			const char * volatile domain; //An endpoint's, or in text
+			const char * volatile path;
+			const char * volatile data; //In text
+			volatile char text[REQUESTTEXTSIZE];
 			volatile int port;
 			volatile RequestType type;
 			volatile bool auto_retry;
+			volatile int id; //0 if this queue slot is free
+			volatile int priority;
+			volatile bool cancelled;
+			volatile bool plain; //Don't ask for gzip, the window was too small
+			volatile int spillError; //Nonzero if poll() should store it
+			volatile unsigned long startTime;
+			RequestCallback volatile callback;
+		};
+		struct Endpoint { //Strings aren't copied, they must stay valid
+			const char *domain;
+			const char *path;
+			int port;
+			RequestType type;
+		};
+		struct Network { //A candidate for roaming
+			char ssid[SSIDSIZE];
+			char password[PASSWORDSIZE];
+		};
+		struct Command {
+			volatile char command[COMMANDSIZE];
+			volatile char terminator[TERMINATORSIZE];
+			char * volatile buffer;
+			volatile int size;
+			volatile unsigned long timeout;
+			CommandCallback volatile callback;
+			volatile int id; //0 if this queue slot is free
+			volatile bool done; //Finished, awaiting delivery by poll()
+			volatile int result;
+			volatile unsigned long elapsed;
+		};
+		struct JsonField {
+			char path[JSON_PATHSIZE];
+			int type;
+			void *dest;
+			int size;
+			volatile bool set; //Found in the current response
+		};
+		struct Link { //A long lived TCP connection
+			int id;
+			volatile char host[DOMAINSIZE];
+			volatile int port;
+			volatile bool wanted; //Should be kept open
+			volatile bool restart; //Close once tx is sent, then reopen
+			volatile unsigned long lastAttempt;
+			volatile uint8_t tx[LINK_TXSIZE]; //Waiting to be sent
+			volatile int txLength;
+			volatile int sendLength; //Being sent by the current CIPSEND
+		};
+		struct MqttSubscription {
+			char filter[MQTT_TOPICSIZE];
+			int qos;
+			MqttCallback callback; //NULL if this slot is free
+		};
+		struct MqttMessage {
+			volatile char topic[MQTT_TOPICSIZE];
+			volatile uint8_t payload[MQTT_PACKETSIZE];
+			volatile int length;
+			volatile bool full; //Awaiting delivery by poll()
+		};
+		struct WsMessage {
+			volatile char data[WS_MESSAGESIZE + 1];
+			volatile int length;
+			volatile bool binary;
+			volatile bool full; //Awaiting delivery by poll()
+		};
+		enum WsState {
+			WS_CLOSED,
+			WS_CONNECTING, //Upgrade request sent, awaiting 101 response
+			WS_OPEN,
+		};
+		enum WsRxState {
+			WS_RX_HANDSHAKE, //Reading the HTTP upgrade response
+			WS_RX_OPCODE,
+			WS_RX_LENGTH,
+			WS_RX_EXTLENGTH, //16 or 64 bit payload length
+			WS_RX_MASK,
+			WS_RX_PAYLOAD,
+		};
+		enum MqttState {
+			MQTT_DISCONNECTED,
+			MQTT_CONNECTING, //CONNECT sent, awaiting CONNACK
+			MQTT_CONNECTED,
+		};
+		struct Completion {
+			int id;
+			RequestCallback callback;
+			int status;
+			int error;
+			unsigned long latency;
+			bool hasBody;
 		};
 		enum State {
 			IDLE, //When nothing is happening
 			CIPSTATUS, //awaiting CIPSTATUS response
 			CWJAP, //connecting to network
+			CWJAPQUERY, //awaiting signal strength of the current AP
+			CWLAP, //awaiting a scan for candidate networks
 			CIPSTART, //awaiting CIPSTART response
 			CIPSEND, //awaiting CIPSEND response
 			DATAOUT, //awaiting "SEND OK" confirmation
 			AWAITRESPONSE, //awaiting HTTP response
+			CUSTOMCOMMAND, //awaiting terminator of a queued custom command
+			CIPMUX, //enabling multiple connections
+			LINKSTART, //opening a persistent link
+			LINKSEND, //awaiting CIPSEND prompt for a persistent link
+			LINKDATAOUT, //awaiting "SEND OK" for a persistent link
+		};
+		enum HttpState {
+			HTTP_NONE, //No response expected
+			HTTP_STATUSLINE,
+			HTTP_HEADERS,
+			HTTP_BODY,
+			HTTP_CHUNKSIZE,
+			HTTP_CHUNKDATA,
+			HTTP_CHUNKEND, //CRLF after chunk data
+			HTTP_DONE,
+			HTTP_FAILED, //Body couldn't be decoded
+		};
+		enum InflateState {
+			INFLATE_HEADER, //gzip member header, read bytewise
+			INFLATE_BLOCK, //3 bit block header
+			INFLATE_STORED, //LEN and NLEN, read bytewise
+			INFLATE_STOREDDATA,
+			INFLATE_TABLESIZES, //HLIT, HDIST and HCLEN
+			INFLATE_CODELENGTHS, //Code length code lengths, 3 bits each
+			INFLATE_LENGTHS, //Literal/length and distance code lengths
+			INFLATE_LENGTHREPEAT, //Extra bits of a repeated code length
+			INFLATE_SYMBOL, //Literal/length symbol
+			INFLATE_LENGTHEXTRA,
+			INFLATE_DISTANCE,
+			INFLATE_DISTEXTRA,
+			INFLATE_TRAILER, //CRC32 and ISIZE, not checked
+			INFLATE_DONE,
+			INFLATE_FAILED,
+		};
+		struct Huffman { //Canonical code, decoded a bit at a time
+			uint16_t count[16]; //Number of codes of each length
+			uint16_t symbol[288]; //Symbols ordered by code
+		};
+		struct Inflater { //Allocated by enableGzip()
+			InflateState state;
+			int headerPos; //Bytes of the fixed header read
+			uint8_t headerFlags; //Optional header fields left to skip
+			int count; //Bytes or lengths read in the current state
+			unsigned int skip; //Of an extra header field, or stored data
+			bool final; //In the last block
+			Huffman *huffman; //Code being decoded, NULL when reading bits
+			int code; //Huffman decoding progress
+			int codeLength;
+			int first;
+			int index;
+			int need; //Bits being read
+			int got;
+			unsigned int value;
+			int literals; //Code lengths of the dynamic block header
+			int distances;
+			int codes;
+			int repeat; //Code length symbol being repeated
+			int length; //Of the match being decoded
+			Huffman lengthCode;
+			Huffman distanceCode; //Also holds the code length code
+			uint8_t lengths[286 + 30];
+			unsigned long total; //Bytes output
+			bool tooFar; //Failed on a reference beyond the window
+			uint8_t window[INFLATE_WINDOWSIZE];
+		};
+		enum JsonState {
+			JSON_VALUE, //Expecting a value
+			JSON_KEY_OR_END, //Expecting a key or '}'
+			JSON_KEY,
+			JSON_COLON,
+			JSON_STRINGVAL,
+			JSON_LITERAL, //Number, true, false or null
+			JSON_AFTER, //Expecting ',' or a closing bracket
+			JSON_END, //Top level value finished
+		};
+
+		// Store-and-forward log records are a status byte, a two byte length
+		// and then the payload: type, priority, auto_retry, two byte port,
+		// domain and path (both null terminated) and data.  The status is
+		// written last.
+		static const uint8_t STORE_FREE = 0xFF; //End of the log
+		static const uint8_t STORE_PENDING = 0x5A;
+		static const uint8_t STORE_DONE = 0x00; //Acknowledged
+		static const int STORE_HEADER = 3;
+
+		// Trace records are a header byte (bit 7 set for TX, low bits hold the
+		// byte count minus one), a varint ms delta from the previous record,
+		// then the bytes themselves.  Dumps are prefixed with a flags byte
+		// holding the state the FSM needs to pick up mid-session.
+		static const uint8_t TRACE_TX = 0x80;
+		static const uint8_t TRACE_COUNT = 0x7F;
+		static const uint8_t TRACE_CONNECTED = 0x01;
+		static const uint8_t TRACE_MUX = 0x02;
+		static const uint8_t TRACE_LINKOPEN = 0x04; //Shifted by link id - 1
+		static const uint8_t TRACE_SESSION = 0x10; //MQTT up or WebSocket open
+		class TraceTx : public Print { //Tees bytes bound for wifiSerial
+			public:
+				virtual size_t write(uint8_t b);
+				using Print::write;
+		};
+		struct TraceCursor {
+			const uint8_t *data;
+			int length;
+			int pos;
+			int remaining; //Bytes left in the current record
+			unsigned long time;
 		};
 
 		// Functions for strictly non-ISR context
@@ -147,6 +569,19 @@ class ESP8266 {
 		bool waitForTarget(const char *target, unsigned long timeout);
 		bool stringToVolatileArray(String str, volatile char arr[], 
 				uint32_t len);
+		int queueRequest(int priority, RequestType type, const char *domain,
+				int port, const char *path, bool copy, const char *data,
+				bool auto_retry, RequestCallback callback);
+		bool storeAppend(int type, int priority, bool auto_retry,
+				const char *domain, int port, const char *path,
+				const char *data);
+		void storeScan();
+		void storeCompact();
+		int storeRecordLength(int pos);
+		void serviceStore();
+		void storeAcknowledge(int pos);
+		static void handleStoreResponse(int id, int status, const char *body,
+				int length, unsigned long latency, int error);
 
 		// Functions for ISR context
 		static void handleInterrupt(void);
@@ -156,6 +591,71 @@ class ESP8266 {
 		bool getStringFromResp(const char *startTarget, const char *endTarget,
 				char *result);
 		int getStatusFromResp(); //Only call if we got an OK CIPSTATUS resp
+		void payloadByte(int link, char c);
+		void lineEvent();
+		void closeLink(int link);
+		void dropLinks();
+		bool serviceLinks();
+		bool linkQueue(volatile Link *link, const uint8_t *data, int length);
+		void linkOpened(volatile Link *link);
+		void linkClosed(volatile Link *link);
+		void mqttTick();
+		void mqttByte(uint8_t c);
+		void mqttPacket();
+		void mqttSubscribe(int index);
+		bool mqttSend(const uint8_t *packet, int length);
+		int mqttPacketId();
+		static int mqttHeader(uint8_t *buf, uint8_t type, int remaining);
+		static int mqttString(uint8_t *buf, const char *str);
+		static bool mqttTopicMatches(const char *filter, const char *topic);
+		void mqttConnect();
+		void wsHandshake();
+		void wsTick();
+		void wsByte(uint8_t c);
+		void wsFrameStart();
+		void wsFrameEnd();
+		bool wsFrame(uint8_t opcode, const uint8_t *data, int length);
+		uint32_t wsNextRandom();
+		void startHttpResponse();
+		void httpByte(char c);
+		void httpLine();
+		void bodyData(char c);
+		void bodyByte(char c);
+		void inflateStart();
+		void inflateByte(uint8_t c);
+		void inflateHeaderByte(uint8_t c);
+		void inflateBit(int bit);
+		void inflateBits(int need);
+		void inflateSymbol(Huffman *h);
+		void inflateValue(unsigned int v);
+		void inflateBlockEnd();
+		void inflateOut(uint8_t c);
+		void inflateFail();
+		static int inflateTable(Huffman *h, const uint8_t *lengths, int n);
+		void jsonByte(char c);
+		void jsonPush(bool array);
+		void jsonPop();
+		void jsonChildPath();
+		void jsonPathAppend(char c);
+		void jsonStartValue();
+		void jsonEndValue();
+		volatile Request *nextRequest();
+		bool selectCommand();
+		bool serviceRoaming();
+		void scanNetworks();
+		void joinNetwork();
+		void nextNetwork();
+		void useNetwork(int index);
+		static const char *atField(const char *line, int field);
+		void finishCommand(int result);
+		void finishRequest(int error);
+		int rxAvailable();
+		char readRx();
+		unsigned long fsmMillis();
+		void traceByte(uint8_t b, bool tx);
+		void tracePut(uint8_t b);
+		void traceDropOldest();
+		bool nextTraceRecord(TraceCursor *cursor, bool tx);
 		void loadRx();
 		void emptyRx();
 		void emptyRxAndBuffer();
@@ -163,20 +663,70 @@ class ESP8266 {
 		// Non-ISR variables
 		String MAC;
 		IntervalTimer timer;
+		TraceTx wifiTx;
+		EEPROMStore eepromStore;
+		WifiStore *store; //NULL unless store-and-forward is enabled
+		int storeEnd; //Where the next record will be appended
+		int storeNext; //Oldest pending record
+		int storeCount; //Pending records
+		int storeRequestId; //Id of the stored request being resent, or 0
+		int storeSending; //Record being resent
+		unsigned long lastStoreDrain;
+		unsigned long storeDelay; //Before the next stored request is resent
+		uint8_t *trace;
+		uint8_t traceFlags;
+		bool replaying;
+		unsigned long replayClock;
+		TraceCursor rxCursor;
+		TraceCursor txCursor;
+		int txMismatches;
 
 		// Shared variables between user calls and interrupt routines
 		volatile bool serialYes;
+		volatile bool started; //begin() has finished
 		volatile bool newNetworkInfo;
 		volatile char ssid[SSIDSIZE];
 		volatile char password[PASSWORDSIZE];
 		volatile bool connected;
+		Network networks[NETWORKCOUNT];
+		volatile int networkCount;
+		volatile int networkIndex; //Candidate in use, -1 if none
+		volatile int joinFailures; //In a row, on different candidates
+		volatile int rssi; //Of the current AP in dBm, 0 if unknown
+		volatile unsigned long lastRssiCheck;
+		volatile unsigned long lastScan;
+		volatile unsigned long requestStart; //When CIPSTART was sent
+		volatile unsigned long linkLatency; //Average request time, in ms
 		volatile bool doAutoConn;
-		volatile bool hasRequest;
-		volatile Request *request_p;
+		volatile Request requestQueue[REQUESTQUEUESIZE];
+		volatile Request *request_p; //Request being processed by the FSM
+		Endpoint endpoints[ENDPOINTCOUNT];
+		volatile int endpointCount;
+		volatile bool requestActive;
+		volatile int nextRequestId;
+		volatile int queueLimit[PRIORITYCOUNT];
+		volatile LatencyStats latencyStats[PRIORITYCOUNT];
+		volatile Completion completions[COMPLETIONQUEUESIZE];
+		volatile int completionHead;
+		volatile int completionCount;
+		volatile bool responseHeld; //response is owned by a pending callback
+		volatile Command commandQueue[COMMANDQUEUESIZE];
+		volatile Command *command_p; //Command being processed by the FSM
+		volatile int nextCommandId;
 		volatile bool responseReady;
+		volatile unsigned long responseTime; //When responseReady was set
 		volatile char response[RESPONSESIZE];
+		volatile int responseLength;
+		JsonField jsonFields[JSONFIELDS];
+		volatile int jsonFieldCount;
 		volatile int transmitCount;
 		volatile int receiveCount;
+		volatile bool tracing;
+		volatile int traceHead;
+		volatile int traceTail;
+		volatile int traceUsed;
+		volatile int traceLast; //Header of the newest record, -1 if none
+		volatile unsigned long traceLastTime;
 	
 		
 		// Variables for interrupt routines
@@ -184,4 +734,91 @@ class ESP8266 {
 		volatile unsigned long lastConnectionCheck;
 		volatile unsigned long timeoutStart;
 		volatile char inputBuffer[BUFFERSIZE];	// Serial input loaded here
+		volatile int ipdMatch; //Characters of "+IPD," matched so far
+		volatile bool ipdHeader; //Reading the length of an +IPD packet
+		volatile int ipdLength;
+		volatile int ipdRemaining; //Payload bytes left in the +IPD packet
+		volatile int ipdLink; //Connection the +IPD packet arrived on
+		volatile char rxLine[RXLINESIZE]; //Start of the current line
+		volatile int rxLineLength;
+		volatile bool muxReady; //Multiple connections are enabled
+		volatile bool linkOpen[LINKCOUNT];
+		Link links[LINKCOUNT - 1]; //Persistent links, HTTP_LINK isn't one
+		volatile Link *link_p; //Link being processed by the FSM
+
+		// MQTT client, on MQTT_LINK
+		volatile MqttState mqttState;
+		volatile char mqttClientId[MQTT_IDSIZE];
+		volatile char mqttUsername[MQTT_USERSIZE];
+		volatile char mqttPassword[MQTT_USERSIZE];
+		MqttSubscription mqttSubs[MQTT_MAXSUBS];
+		MqttMessage mqttInbox[MQTT_INBOXSIZE];
+		volatile unsigned long mqttConnectStart;
+		volatile unsigned long mqttLastTx;
+		volatile bool mqttPingOutstanding;
+		volatile unsigned long mqttPingSent;
+		volatile int mqttNextPacketId;
+		volatile uint8_t mqttInflight[MQTT_PACKETSIZE]; //Unacknowledged QoS 1
+		volatile int mqttInflightLength; //0 if none
+		volatile int mqttInflightId;
+		volatile unsigned long mqttInflightSent;
+		volatile int mqttRxState; //0 fixed header, 1 length, 2 body
+		volatile uint8_t mqttRxHeader;
+		volatile int mqttRxLength; //Remaining length of the packet
+		volatile int mqttRxShift;
+		volatile int mqttRxCount; //Body bytes received
+		volatile uint8_t mqttRx[MQTT_PACKETSIZE];
+
+		// WebSocket client, on WS_LINK
+		volatile WsState wsState;
+		volatile char wsPath[PATHSIZE];
+		WebSocketCallback wsCallback;
+		WsMessage wsInbox[WS_INBOXSIZE];
+		volatile int wsSlot; //Inbox slot being filled, -1 if none
+		volatile uint32_t wsRandom; //For handshake keys and frame masks
+		volatile unsigned long wsConnectStart;
+		volatile unsigned long wsLastRx;
+		volatile bool wsPingOutstanding;
+		volatile unsigned long wsPingSent;
+		volatile WsRxState wsRxState;
+		volatile char wsStatusLine[16]; //Start of the upgrade response
+		volatile int wsStatusLength;
+		volatile int wsHeaderMatch; //Characters of "\r\n\r\n" matched
+		volatile bool wsRxFin;
+		volatile uint8_t wsRxOpcode;
+		volatile bool wsRxMasked;
+		volatile uint8_t wsRxMask[4];
+		volatile int wsRxLengthBytes; //Of extended length left to read
+		volatile unsigned long wsRxLength; //Payload length of this frame
+		volatile unsigned long wsRxCount; //Payload bytes read
+		volatile uint8_t wsControl[WS_CONTROLSIZE]; //Control frame payload
+		volatile int wsControlLength;
+
+		// HTTP response parser
+		volatile HttpState httpState;
+		volatile char httpLineBuffer[HTTP_LINESIZE];
+		volatile int httpLineLength;
+		volatile int httpStatus;
+		volatile long contentLength; //-1 if not given
+		volatile long bodyRemaining; //Of the body, or the current chunk
+		volatile bool chunked;
+		volatile int htmlEndMatch; //Characters of HTML_END matched so far
+		volatile bool gzip; //Ask for gzip compressed responses
+		volatile bool gzipRequest; //The current request asked for gzip
+		volatile bool gzipBody; //The current body is being inflated
+		Inflater *inflater;
+
+		// JSON tokenizer, matching paths like "data.items.0.id"
+		volatile JsonState jsonState;
+		volatile int jsonDepth;
+		volatile uint32_t jsonArrays; //Bit n set if level n is an array
+		volatile int jsonBase[JSON_MAXDEPTH]; //Path length of each container
+		volatile int jsonIndex[JSON_MAXDEPTH]; //Current array index
+		volatile char jsonPath[JSON_PATHSIZE];
+		volatile int jsonPathLength; //May exceed JSON_PATHSIZE if too long
+		volatile bool jsonEscape;
+		volatile int jsonSkip; //Hex digits of a \u escape left to skip
+		volatile uint32_t jsonMatches; //Bit n set if field n matches
+		volatile char jsonValue[JSON_VALUESIZE];
+		volatile int jsonValueLength;
 };
@@ -0,0 +1,54 @@
+#include <Wifi_S08.h>
+
+#define SSID "EECS-ConfRooms"
+#define PASSWD ""
+#define POLLPERIOD 5000
+
+// Fetches the same page alternately with and without gzip, and compares the
+// average request latency.  Most of the difference is time on the UART.
+ESP8266 wifi;
+
+unsigned long lastRequest = 0;
+bool compressed = false;
+unsigned long total[2] = {0, 0};
+unsigned long count[2] = {0, 0};
+
+void onResponse(int id, int status, const char *body, int length,
+		unsigned long latency, int error) {
+  if (error != REQUEST_OK) {
+    Serial.print("Request failed with error ");
+    Serial.println(error);
+    return;
+  }
+  total[compressed] += latency;
+  count[compressed]++;
+  Serial.print(compressed ? "gzip:  " : "plain: ");
+  Serial.print(length);
+  Serial.print(" bytes in ");
+  Serial.print(latency);
+  Serial.print("ms, average ");
+  Serial.print(total[compressed] / count[compressed]);
+  Serial.println("ms");
+  compressed = !compressed;
+  if (compressed) {
+    wifi.enableGzip();
+  } else {
+    wifi.disableGzip();
+  }
+}
+
+void setup() {
+  Serial.begin(115200);
+  wifi.begin();
+  wifi.connectWifi(SSID, PASSWD);
+  while (!wifi.isConnected()); //wait for connection
+}
+
+void loop() {
+  wifi.poll();
+
+  if (millis()-lastRequest > POLLPERIOD && !wifi.isBusy()) {
+    wifi.sendRequest(GET, "iesc-s2.mit.edu", 80, "/index.html", "", onResponse);
+    lastRequest = millis();
+  }
+}
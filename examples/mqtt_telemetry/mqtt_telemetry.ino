@@ -0,0 +1,36 @@
+#include <Wifi_S08.h>
+
+#define SSID "EECS-ConfRooms"
+#define PASSWD ""
+#define BROKER "iesc-s2.mit.edu"
+#define PUBLISHPERIOD 5000
+
+ESP8266 wifi;
+
+unsigned long lastPublish = 0;
+
+// Called from wifi.poll() for messages on "s08/led/..."
+void onCommand(const char *topic, const uint8_t *payload, int length) {
+  Serial.print(topic);
+  Serial.print(": ");
+  Serial.write(payload, length);
+  Serial.println();
+}
+
+void setup() {
+  Serial.begin(115200);
+  wifi.begin();
+  wifi.connectWifi(SSID, PASSWD);
+  // One connection stays open for both directions, and is reopened if it drops
+  wifi.connectMqtt(BROKER, 1883, "s08-telemetry");
+  wifi.subscribeMqtt("s08/led/+", 1, onCommand);
+}
+
+void loop() {
+  wifi.poll();
+
+  if (wifi.isMqttConnected() && millis()-lastPublish > PUBLISHPERIOD) {
+    wifi.publishMqtt("s08/uptime", String(millis()));
+    lastPublish = millis();
+  }
+}
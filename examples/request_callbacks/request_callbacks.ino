@@ -0,0 +1,47 @@
+#include <Wifi_S08.h>
+
+#define SSID "EECS-ConfRooms"
+#define PASSWD ""
+#define POLLPERIOD 5000
+
+ESP8266 wifi;
+
+unsigned long lastRequest = 0;
+
+// Called from wifi.poll() once a request has finished
+void onResponse(int id, int status, const char *body, int length,
+		unsigned long latency, int error) {
+  Serial.print("Request ");
+  Serial.print(id);
+  if (error != REQUEST_OK) {
+    Serial.print(" failed with error ");
+    Serial.println(error);
+    return;
+  }
+  Serial.print(" got HTTP ");
+  Serial.print(status);
+  Serial.print(" in ");
+  Serial.print(latency);
+  Serial.print("ms, ");
+  Serial.print(length);
+  Serial.println(" bytes:");
+  Serial.println(body);
+}
+
+void setup() {
+  Serial.begin(115200);
+  wifi.begin();
+  wifi.connectWifi(SSID, PASSWD);
+  while (!wifi.isConnected()); //wait for connection
+}
+
+void loop() {
+  wifi.poll();
+
+  if (millis()-lastRequest > POLLPERIOD) {
+    // Both requests are queued; each reports back through onResponse
+    wifi.sendRequest(GET, "iesc-s2.mit.edu", 80, "/hello.html", "", onResponse);
+    wifi.sendRequest(GET, "iesc-s2.mit.edu", 80, "/index.html", "", onResponse);
+    lastRequest = millis();
+  }
+}
@@ -0,0 +1,51 @@
+#include <Wifi_S08.h>
+
+// Replays a trace captured with startTrace()/dumpTrace() through the FSM
+// and prints how long the interrupt handler took.  To capture one, call
+// wifi.startTrace() right after connectWifi() in the sketch under test and
+// wifi.dumpTrace() once the interesting request has finished, then paste the
+// printed bytes into trace[] below.  The module doesn't need to be attached.
+
+#define SSID "EECS-ConfRooms"
+#define PASSWD ""
+
+const uint8_t trace[] = {
+  0x00, // paste dumpTrace() output here
+};
+
+ESP8266 wifi;
+
+void setup() {
+  Serial.begin(115200);
+  while (!Serial);
+
+  // Recreate what the sketch did while the trace was captured
+  wifi.connectWifi(SSID, PASSWD);
+  wifi.sendRequest(GET, "iesc-s2.mit.edu", 80, "/hello.html", "");
+
+  ReplayStats stats;
+  bool matched = wifi.replayTrace(trace, sizeof(trace), &stats);
+  Serial.print("Simulated ");
+  Serial.print(stats.duration);
+  Serial.print("ms in ");
+  Serial.print(stats.ticks);
+  Serial.println(" interrupts");
+  Serial.print("Interrupt time: ");
+  Serial.print(stats.isrMicros);
+  Serial.print("us total, ");
+  Serial.print(stats.maxIsrMicros);
+  Serial.println("us max");
+  if (matched) {
+    Serial.println("FSM output matched the trace");
+  } else {
+    Serial.print("FSM output diverged from the trace in ");
+    Serial.print(stats.txMismatches);
+    Serial.println(" bytes");
+  }
+  if (wifi.hasResponse()) {
+    Serial.println(wifi.getResponse());
+  }
+}
+
+void loop() {
+}